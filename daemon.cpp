@@ -0,0 +1,290 @@
+// Copyright 2014 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// elfling - a linking compressor for ELF files by Minas ^ Calodox
+
+#include "daemon.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A request is the magic, the key as length and bytes, the startup weight as
+// a double, a byte of DAEMON_ flags, the prior if DAEMON_PRIOR is set, the
+// parameters to start from, the input as length and bytes, and the maximum
+// output length. The reply is a status byte, the parameters and the output as
+// length and bytes. Parameters are the format, the context count and
+// MAX_CONTEXT_COUNT weights and masks. A prior is its format, inputs, context
+// count and mask count as ints, then count masks, hits and weights. All
+// numbers are in host byte order, the daemon only serves its own machine. The
+// last byte of the magic counts changes to the request.
+static const char daemonMagic[4] = { 'E', 'L', 'F', '2' };
+
+#define DAEMON_PRUNE 1
+#define DAEMON_STRIDES 2
+#define DAEMON_PRIOR 4
+
+// The largest input the daemon accepts.
+#define DAEMON_MAX_INPUT (256 << 20)
+
+static bool ReadAll(int fd, void* data, size_t len) {
+  u8* p = (u8*)data;
+  while (len) {
+    ssize_t l = recv(fd, p, len, 0);
+    if (l <= 0) return false;
+    p += l;
+    len -= l;
+  }
+  return true;
+}
+
+static bool WriteAll(int fd, const void* data, size_t len) {
+  const u8* p = (const u8*)data;
+  while (len) {
+    ssize_t l = send(fd, p, len, MSG_NOSIGNAL);
+    if (l <= 0) return false;
+    p += l;
+    len -= l;
+  }
+  return true;
+}
+
+static bool ReadParams(int fd, CompressionParameters* params) {
+  u8 p[2 + 2 * MAX_CONTEXT_COUNT];
+  if (!ReadAll(fd, p, sizeof(p)) || p[1] > MAX_CONTEXT_COUNT) return false;
+  params->format = p[0];
+  params->contextCount = p[1];
+  memcpy(params->weights, &p[2], MAX_CONTEXT_COUNT);
+  memcpy(params->contexts, &p[2 + MAX_CONTEXT_COUNT], MAX_CONTEXT_COUNT);
+  return true;
+}
+
+static bool WriteParams(int fd, const CompressionParameters& params) {
+  u8 p[2 + 2 * MAX_CONTEXT_COUNT];
+  p[0] = params.format;
+  p[1] = params.contextCount;
+  memcpy(&p[2], params.weights, MAX_CONTEXT_COUNT);
+  memcpy(&p[2 + MAX_CONTEXT_COUNT], params.contexts, MAX_CONTEXT_COUNT);
+  return WriteAll(fd, p, sizeof(p));
+}
+
+static bool ReadPrior(int fd, ContextPrior* prior) {
+  int p[4];
+  if (!ReadAll(fd, p, sizeof(p)) || p[3] < 0 || p[3] > 255) return false;
+  prior->format = p[0];
+  prior->inputs = p[1];
+  prior->contextCount = p[2];
+  prior->count = p[3];
+  return ReadAll(fd, prior->masks, prior->count) && ReadAll(fd, prior->hits, 2 * prior->count) &&
+         ReadAll(fd, prior->weights, prior->count);
+}
+
+static bool WritePrior(int fd, const ContextPrior& prior) {
+  int p[4] = { prior.format, prior.inputs, prior.contextCount, prior.count };
+  return WriteAll(fd, p, sizeof(p)) && WriteAll(fd, prior.masks, prior.count) &&
+         WriteAll(fd, prior.hits, 2 * prior.count) && WriteAll(fd, prior.weights, prior.count);
+}
+
+static void SocketAddress(const char* socketPath, sockaddr_un* addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  strncpy(addr->sun_path, socketPath, sizeof(addr->sun_path) - 1);
+}
+
+bool DaemonCompress(const char* socketPath, const char* key, const DaemonOptions& options, CompressionParameters* params,
+                    const void* in, int inLen, void* out, int* outLen) {
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) return false;
+  sockaddr_un addr;
+  SocketAddress(socketPath, &addr);
+  if (connect(fd, (sockaddr*)&addr, sizeof(addr))) {
+    close(fd);
+    return false;
+  }
+  u32 keyLen = strlen(key);
+  u32 len = inLen, limit = *outLen;
+  u8 ok = 0;
+  u8 flags = (options.prune ? DAEMON_PRUNE : 0) | (options.strides ? DAEMON_STRIDES : 0) |
+             (options.prior ? DAEMON_PRIOR : 0);
+  bool rv = WriteAll(fd, daemonMagic, 4) && WriteAll(fd, &keyLen, 4) && WriteAll(fd, key, keyLen) &&
+            WriteAll(fd, &options.startupWeight, sizeof(options.startupWeight)) && WriteAll(fd, &flags, 1) &&
+            (!options.prior || WritePrior(fd, *options.prior)) && WriteParams(fd, *params) &&
+            WriteAll(fd, &len, 4) && WriteAll(fd, in, len) && WriteAll(fd, &limit, 4) &&
+            ReadAll(fd, &ok, 1) && ok && ReadParams(fd, params) && ReadAll(fd, &len, 4) && len <= limit &&
+            ReadAll(fd, out, len);
+  close(fd);
+  if (rv) *outLen = len;
+  return rv;
+}
+
+// What the daemon keeps per key between requests.
+struct DaemonEntry {
+  u64 hash;  // Of the data of the last request, with its format, startup weight, flags and prior.
+  bool strides;  // Whether the last search could use stride contexts.
+  CompressionParameters params;
+  PatternRanking ranking;
+};
+
+// The state of the daemon, shared by the threads that serve requests.
+struct DaemonState {
+  ParallelFn parallel;
+  void* ctx;
+  std::mutex lock;
+  std::map<std::string, DaemonEntry> entries;
+  std::vector<Compressor*> idle;  // Compressors kept for the next requests.
+};
+
+static u64 HashData(u64 h, const void* data, u32 len) {
+  for (u32 i = 0; i < len; ++i) {
+    h = (h ^ ((const u8*)data)[i]) * 0x100000001b3ull;  // FNV-1a
+  }
+  return h;
+}
+
+static u64 HashRequest(const u8* data, u32 len, int format, double startupWeight, u8 flags,
+                       const ContextPrior& prior) {
+  u64 h = HashData(0xcbf29ce484222325ull, data, len);
+  h = HashData(h, &flags, 1);
+  if (flags & DAEMON_PRIOR) {
+    h = HashData(h, &prior.format, sizeof(prior.format));
+    h = HashData(h, &prior.contextCount, sizeof(prior.contextCount));
+    h = HashData(h, prior.masks, prior.count);
+    h = HashData(h, prior.hits, 2 * prior.count);
+    h = HashData(h, prior.weights, prior.count);
+  }
+  u64 w;
+  memcpy(&w, &startupWeight, 8);
+  return (h ^ format) * 0x100000001b3ull ^ w;
+}
+
+static void Serve(DaemonState* state, int fd) {
+  char magic[4];
+  u32 keyLen = 0, len = 0, limit = 0;
+  double startupWeight = 0;
+  u8 flags = 0;
+  ContextPrior prior;
+  CompressionParameters params;
+  std::string key;
+  std::vector<u8> in, out;
+  bool rv = ReadAll(fd, magic, 4) && !memcmp(magic, daemonMagic, 4) && ReadAll(fd, &keyLen, 4) && keyLen < 4096;
+  if (rv) {
+    key.resize(keyLen);
+    rv = ReadAll(fd, &key[0], keyLen) && ReadAll(fd, &startupWeight, sizeof(startupWeight)) &&
+         ReadAll(fd, &flags, 1) && (!(flags & DAEMON_PRIOR) || ReadPrior(fd, &prior)) && ReadParams(fd, &params) && ReadAll(fd, &len, 4) && len > 0 && len <= DAEMON_MAX_INPUT;
+  }
+  if (rv) {
+    in.resize(len);
+    rv = ReadAll(fd, in.data(), len) && ReadAll(fd, &limit, 4) && limit <= 2 * len + 1024;
+  }
+  if (!rv) {
+    close(fd);
+    return;
+  }
+
+  time_t start = time(nullptr);
+  u64 hash = HashRequest(in.data(), len, params.format, startupWeight, flags, prior);
+  bool strides = flags & DAEMON_STRIDES;
+  DaemonEntry entry;
+  bool known, same;
+  Compressor* c;
+  {
+    std::lock_guard<std::mutex> l(state->lock);
+    std::map<std::string, DaemonEntry>::iterator it = state->entries.find(key);
+    // Parameters and rankings found with stride contexts only suit searches
+    // that may use them, and the other way round.
+    known = it != state->entries.end() && it->second.params.format == params.format &&
+            it->second.strides == strides;
+    if (known) entry = it->second;
+    if (state->idle.empty()) {
+      c = new Compressor();
+    } else {
+      c = state->idle.back();
+      state->idle.pop_back();
+    }
+  }
+  same = known && entry.hash == hash;
+  if (same) {
+    params = entry.params;
+  } else {
+    if (known && !params.contextCount) params = entry.params;
+    c->SetQuiet(true);
+    c->SetStartupWeight(startupWeight);
+    c->SetPrune(flags & DAEMON_PRUNE);
+    c->SetStrides(strides);
+    c->SetPrior(flags & DAEMON_PRIOR ? &prior : nullptr);
+    c->SetParallel(state->parallel, state->ctx);
+    c->SetPatternRanking(&entry.ranking);
+    c->Optimize(&params, in.data(), len, nullptr, nullptr, nullptr);
+    c->SetPatternRanking(nullptr);
+    c->SetPrior(nullptr);
+  }
+  out.resize(limit);
+  int outLen = limit;
+  u8 ok = c->CompressSingle(&params, in.data(), len, out.data(), &outLen);
+  if (ok) {
+    printf("%s: %u -> %d bytes, %s in %d s\n", key.c_str(), len, outLen, same ? "known data" :
+           known ? "searched from the last parameters" : "searched", (int)(time(nullptr) - start));
+    fflush(stdout);
+  }
+  {
+    std::lock_guard<std::mutex> l(state->lock);
+    state->idle.push_back(c);
+    if (ok) {
+      entry.hash = hash;
+      entry.strides = strides;
+      entry.params = params;
+      state->entries[key] = entry;
+    }
+  }
+  u32 outSize = outLen;
+  if (WriteAll(fd, &ok, 1) && ok) {
+    WriteParams(fd, params) && WriteAll(fd, &outSize, 4) && WriteAll(fd, out.data(), outSize);
+  }
+  close(fd);
+}
+
+void DaemonServe(const char* socketPath, ParallelFn parallel, void* ctx) {
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    printf("Could not create socket\n");
+    return;
+  }
+  sockaddr_un addr;
+  SocketAddress(socketPath, &addr);
+  unlink(socketPath);
+  if (bind(fd, (sockaddr*)&addr, sizeof(addr)) || listen(fd, 16)) {
+    printf("Could not listen on %s\n", socketPath);
+    close(fd);
+    return;
+  }
+  printf("Serving on %s\n", socketPath);
+  fflush(stdout);
+  DaemonState* state = new DaemonState();
+  state->parallel = parallel;
+  state->ctx = ctx;
+  for (;;) {
+    int client = accept(fd, nullptr, nullptr);
+    if (client < 0) continue;
+    std::thread([state, client]() { Serve(state, client); }).detach();
+  }
+}
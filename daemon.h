@@ -0,0 +1,54 @@
+// Copyright 2014 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// elfling - a linking compressor for ELF files by Minas ^ Calodox
+
+#ifndef INCLUDED_DAEMON_H
+#define INCLUDED_DAEMON_H
+
+#include "pack.h"
+
+//! What a link asks of the daemon besides its data, from the flags it was given.
+struct DaemonOptions {
+  double startupWeight = 0;  // As for Compressor::SetStartupWeight.
+  bool prune = false;  // As for Compressor::SetPrune.
+  bool strides = false;  // As for Compressor::SetStrides.
+  const ContextPrior* prior = nullptr;  // As for Compressor::SetPrior, if not null.
+};
+
+//! Has the daemon listening on socketPath search parameters for data and compress it.
+/*! The daemon keeps its Compressors and, per key, the parameters and mask
+    ranking of the last search, and starts the next search for the same key
+    from them. Data it has seen before under the same key is not searched
+    again.
+    \param socketPath Path of the Unix domain socket of the daemon.
+    \param key Names what is compressed, such as the output file, so that repeated links find their earlier results.
+    \param options How to search, as a Compressor of the link would.
+    \param params Parameters to start from if it holds any, filled out with the parameters found.
+    \param in Pointer to input data.
+    \param inLen Length of input data in bytes.
+    \param out Pointer to output data, as written by Compressor::CompressSingle.
+    \param outLen Pointer to length of output data. Must contain maximum length of output data as input.
+    \return false if the daemon could not be reached or could not compress the data.
+*/
+bool DaemonCompress(const char* socketPath, const char* key, const DaemonOptions& options, CompressionParameters* params,
+                    const void* in, int inLen, void* out, int* outLen);
+
+//! Serves DaemonCompress requests on socketPath, each on a thread of its own.
+/*! Searches spread their trial compressions with parallel, as with
+    Compressor::SetParallel. Only returns if the socket cannot be set up.
+*/
+void DaemonServe(const char* socketPath, ParallelFn parallel, void* ctx);
+
+#endif  // INCLUDED_DAEMON_H
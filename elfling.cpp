@@ -15,20 +15,52 @@
 // elfling - a linking compressor for ELF files by Minas ^ Calodox
 
 #include <elf.h>
+#include <fcntl.h>
 #include <malloc.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <set>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "header32.h"
+#include "header32b.h"
+#include "header32m.h"
+#include "header32s.h"
+#include "header32st.h"
+#include "header32t.h"
 #include "header64.h"
+#include "header64b.h"
+#include "header64m.h"
+#include "header64s.h"
+#include "header64st.h"
+#include "header64t.h"
+#include "daemon.h"
 #include "pack.h"
 
-bool verbose = false;
+typedef std::map<char, std::set<std::string>> Args;
+
+// The arguments of the link running on this thread, and whether it is verbose.
+// Tasks of the TaskPool run with those of the link that handed them out.
+thread_local const Args* args = nullptr;
+thread_local bool verbose = false;
+// Name of the batch job running on this thread, nullptr outside of batch mode.
+thread_local const char* jobName = nullptr;
 
 typedef unsigned char u8;
 typedef unsigned int u32;
@@ -53,37 +85,17 @@ template<> struct Elf<64> {
   typedef Elf64_Rela Rela;
 };
 
+// A section of a loaded object. The data is not copied, it points into the
+// MemFile the object was loaded from, which has to outlive the Section.
 template<int bits> class Section {
   typedef Elf<bits> E;
 public:
   Section(const char* name) : name_(name) {}
-  ~Section() {
-    delete[] data_;
-  }
   
   void Set(const void* data, u32 size) {
-    if (size > limit_) {
-      delete[] data_;
-      data_ = new u8[size];
-      limit_ = size; 
-    }
-    memcpy(data_, data, size);
+    data_ = (const u8*)data;
     size_ = size; 
   }
-  void Reset() {
-    size_ = 0;
-  }
-  void Append(const void* data, u32 size) {
-    if (size + size_ > limit_) {
-      limit_ = (size + size_ + 0x0fff) & (~0x0fff);
-      u8* nd = new u8[limit_];
-      memcpy(nd, data_, size_);
-      delete[] data_;
-      data_ = nd;
-    }
-    memcpy(&data_[size_], data, size);
-    size_ += size; 
-  }
   void SetHdr(const typename E::Shdr& hdr) {
     hdr_ = hdr;
   }
@@ -96,35 +108,42 @@ public:
 protected:
   std::string name_;
   u32 size_ = 0;
-  u32 limit_ = 0;
-  u8* data_ = nullptr;
+  const u8* data_ = nullptr;
 
   typename E::Shdr hdr_;
 };
 
+// A read-only mapping of a whole file.
 class MemFile {
 public:
   MemFile() {}
   ~MemFile() {
-    delete[] data_;
+    if (data_) {
+      munmap((void*)data_, size_);
+    }
   }
   bool Load(const char* fn) {
     name_ = fn;
-    FILE* fptr = fopen(fn, "rb");
-    if (!fptr) {
+    int fd = open(fn, O_RDONLY);
+    if (fd < 0) {
       printf("Could not open %s\n", fn);
       return false;
     }
-    fseek(fptr, 0, SEEK_END);
-    size_ = ftell(fptr);
-    fseek(fptr, 0, 0);
-    data_ = new u8[size_];
-    u32 rl = fread(data_, 1, size_, fptr);
-    if (size_ != rl) {
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size == 0) {
       printf("Could not read %s\n", fn);
+      close(fd);
       return false;
     }
-    fclose(fptr);
+    size_ = st.st_size;
+    void* data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+      printf("Could not map %s\n", fn);
+      size_ = 0;
+      return false;
+    }
+    data_ = (const u8*)data;
     return true;
   }
 
@@ -133,11 +152,208 @@ public:
   size_t Size() const { return size_; }
 
 private:
-  u8* data_ = nullptr;
+  const u8* data_ = nullptr;
   size_t size_ = 0;
   std::string name_;
 };
 
+// An object to link: a whole file, or a member of an archive. The data
+// points into the MemFile it came from.
+struct Input {
+  std::string name;
+  const u8* data;
+  size_t size;
+  bool archiveMember;  // Only linked if it defines a symbol that is needed.
+
+  const char* Name() const { return name.c_str(); }
+  const u8* Data() const { return data; }
+  size_t Size() const { return size; }
+};
+
+// Adds the members of an ar archive (System V/GNU or BSD names) to inputs.
+bool ReadArchive(MemFile* f, std::vector<Input>* inputs) {
+  const u8* p = f->Data() + 8;
+  const u8* end = f->Data() + f->Size();
+  const char* longNames = nullptr;
+  size_t longNamesSize = 0;
+  while (p + 60 <= end) {
+    char name[17], size[11];
+    memcpy(name, p, 16);
+    name[16] = 0;
+    memcpy(size, p + 48, 10);
+    size[10] = 0;
+    const u8* data = p + 60;
+    size_t l = strtoul(size, nullptr, 10);
+    if (memcmp(p + 58, "`\n", 2) || data + l > end) {
+      printf("Invalid archive member header in %s\n", f->Name());
+      return false;
+    }
+    p = data + l + (l & 1);
+    std::string member;
+    if (!strncmp(name, "// ", 3)) {  // GNU table of long names.
+      longNames = (const char*)data;
+      longNamesSize = l;
+      continue;
+    } else if (name[0] == '/' && (name[1] == ' ' || !strncmp(name, "/SYM64/", 7))) {  // Symbol index.
+      continue;
+    } else if (name[0] == '/') {  // GNU long name, /offset into the table.
+      size_t o = strtoul(&name[1], nullptr, 10);
+      if (!longNames || o >= longNamesSize) {
+        printf("Invalid long member name in %s\n", f->Name());
+        return false;
+      }
+      for (const char* c = &longNames[o]; c < longNames + longNamesSize && *c != '/' && *c != '\n'; ++c) {
+        member += *c;
+      }
+    } else if (!strncmp(name, "#1/", 3)) {  // BSD, the name precedes the data.
+      size_t nl = strtoul(&name[3], nullptr, 10);
+      if (nl > l) {
+        printf("Invalid member name in %s\n", f->Name());
+        return false;
+      }
+      member.assign((const char*)data, strnlen((const char*)data, nl));
+      data += nl;
+      l -= nl;
+    } else {
+      for (const char* c = name; *c && *c != '/' && *c != ' '; ++c) {
+        member += *c;
+      }
+    }
+    Input in = { std::string(f->Name()) + "(" + member + ")", data, l, true };
+    inputs->push_back(in);
+  }
+  return true;
+}
+
+// Worker threads that run the parallel parts of all links of a run, one
+// thread per core. Every worker has a queue of its own and takes its tasks
+// from the back of it, and steals from the front of the other queues when it
+// runs dry. Tasks must not wait for other tasks, only the threads that hand
+// them out wait, so link stages of several batch jobs can share the workers.
+class TaskPool {
+public:
+  ~TaskPool() {
+    {
+      std::lock_guard<std::mutex> l(lock_);
+      stop_ = true;
+    }
+    wake_.notify_all();
+    for (std::thread& t : threads_) {
+      t.join();
+    }
+  }
+
+  void Start(u32 threadCount) {
+    queues_.resize(threadCount);
+    for (u32 i = 0; i < threadCount; ++i) {
+      queues_[i].reset(new Queue());
+    }
+    for (u32 i = 0; i < threadCount; ++i) {
+      threads_.push_back(std::thread([this, i]() { Work(i); }));
+    }
+  }
+
+  u32 ThreadCount() const { return threads_.size(); }
+
+  // Runs work(i) for all i in [0, count) and returns when all are done.
+  void Run(u32 count, const std::function<void(u32)>& work) {
+    if (threads_.empty()) {
+      for (u32 i = 0; i < count; ++i) {
+        work(i);
+      }
+      return;
+    }
+    u32 left = count;  // Guarded by doneLock, so Run cannot return before the last task lets go of it.
+    std::mutex doneLock;
+    std::condition_variable done;
+    const Args* a = args;
+    bool v = verbose;
+    const char* job = jobName;
+    u32 first = next_++;
+    for (u32 i = 0; i < count; ++i) {
+      Queue* q = queues_[(first + i) % queues_.size()].get();
+      std::lock_guard<std::mutex> l(q->lock);
+      q->tasks.push_back([&, a, v, job, i]() {
+        args = a;
+        verbose = v;
+        jobName = job;
+        work(i);
+        std::lock_guard<std::mutex> l(doneLock);
+        if (--left == 0) done.notify_all();
+      });
+    }
+    {
+      std::lock_guard<std::mutex> l(lock_);
+      queued_ += count;
+    }
+    wake_.notify_all();
+    std::unique_lock<std::mutex> l(doneLock);
+    done.wait(l, [&]() { return left == 0; });
+  }
+
+private:
+  struct Queue {
+    std::mutex lock;
+    std::deque<std::function<void()>> tasks;
+  };
+
+  void Work(u32 self) {
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> l(lock_);
+        wake_.wait(l, [&]() { return stop_ || queued_ > 0; });
+        if (stop_) return;
+        --queued_;
+      }
+      // A task is queued for every count taken, so one of the queues has it.
+      std::function<void()> task;
+      for (u32 i = 0; !task; i = (i + 1) % queues_.size()) {
+        Queue* q = queues_[(self + i) % queues_.size()].get();
+        std::lock_guard<std::mutex> l(q->lock);
+        if (q->tasks.empty()) continue;
+        if (i == 0) {
+          task = std::move(q->tasks.back());
+          q->tasks.pop_back();
+        } else {
+          task = std::move(q->tasks.front());
+          q->tasks.pop_front();
+        }
+      }
+      task();
+    }
+  }
+
+  std::vector<std::unique_ptr<Queue>> queues_;
+  std::vector<std::thread> threads_;
+  std::atomic<u32> next_{0};  // Queue of the first task of the next Run.
+  std::mutex lock_;
+  std::condition_variable wake_;
+  u32 queued_ = 0;  // Tasks in the queues that no worker has taken yet.
+  bool stop_ = false;
+};
+
+TaskPool pool;
+
+// Runs work(i) for all i in [0, count) on the workers of the pool.
+template<typename F> void ParallelFor(u32 count, F work) {
+  pool.Run(count, std::function<void(u32)>(work));
+}
+
+// Returns the Compressor for trial compressions on this thread.
+Compressor* ThreadCompressor() {
+  thread_local std::unique_ptr<Compressor> c;
+  if (!c) {
+    c.reset(new Compressor());
+    c->SetQuiet(true);
+  }
+  return c.get();
+}
+
+// Runs the trial compressions of Compressor::Search on the pool.
+void ParallelTrials(void*, int count, TrialFn work, void* arg) {
+  ParallelFor(count, [&](u32 i) { work(arg, i, ThreadCompressor()); });
+}
+
 template<int bits> class Image {
   typedef Elf<bits> E;
 public:
@@ -148,9 +364,13 @@ public:
     }
   }
   
-  bool Load(MemFile* f) {
+  bool Load(const Input* f) {
     const u8* obj = f->Data();
     u8 elfMagic[4] = {0x7f, 0x45, 0x4c, 0x46};
+    if (f->Size() < sizeof(ehdr_)) {
+      printf("%s is too small for an ELF header\n", f->Name());
+      return false;
+    }
     memcpy(&ehdr_, obj, sizeof(ehdr_));
     if (memcmp(ehdr_.e_ident, elfMagic, 4)) {
       printf("Invalid header signature in %s\n", f->Name());
@@ -161,21 +381,34 @@ public:
         printf("Object %s has unexpected e_phentsize (%d != %lu)\n", f->Name(), ehdr_.e_phentsize, sizeof(typename E::Phdr));
         return false;
       }
-      memcpy(phdr_, &obj[ehdr_.e_phoff], ehdr_.e_phnum * ehdr_.e_phentsize);
+      if (ehdr_.e_phoff + ehdr_.e_phnum * ehdr_.e_phentsize > f->Size()) {
+        printf("Program headers of %s are out of bounds\n", f->Name());
+        return false;
+      }
+      phdr_ = (const typename E::Phdr*)&obj[ehdr_.e_phoff];
     }
     if (ehdr_.e_shentsize != sizeof(typename E::Shdr)) { 
       printf("Object %s has unexpected e_shentsize (%d != %lu)\n", f->Name(), ehdr_.e_shentsize, sizeof(typename E::Shdr));
       return false;
     }
-    memcpy(shdr_, &obj[ehdr_.e_shoff], ehdr_.e_shnum * ehdr_.e_shentsize);
+    if (ehdr_.e_shoff + ehdr_.e_shnum * ehdr_.e_shentsize > f->Size() || ehdr_.e_shstrndx >= ehdr_.e_shnum) {
+      printf("Section headers of %s are out of bounds\n", f->Name());
+      return false;
+    }
+    shdr_ = (const typename E::Shdr*)&obj[ehdr_.e_shoff];
     
     // Get the strings for now
-    char* strings = (char*)&obj[shdr_[ehdr_.e_shstrndx].sh_offset];
+    const char* strings = (const char*)&obj[shdr_[ehdr_.e_shstrndx].sh_offset];
     for (u32 i = 0; i < ehdr_.e_shnum; ++i) {
       if (verbose)
         printf("Loading section '%s' at offset 0x%x, %d bytes\n", &strings[shdr_[i].sh_name], (u32)shdr_[i].sh_offset, (int)shdr_[i].sh_size);  
       Section<bits>* s = new Section<bits>(&strings[shdr_[i].sh_name]);
       if (shdr_[i].sh_type != SHT_NOBITS) {
+        if (shdr_[i].sh_offset + shdr_[i].sh_size > f->Size()) {
+          printf("Section '%s' of %s is out of bounds\n", s->Name().c_str(), f->Name());
+          delete s;
+          return false;
+        }
         s->Set(&obj[shdr_[i].sh_offset], shdr_[i].sh_size);
       }
       s->SetHdr(shdr_[i]);
@@ -197,8 +430,9 @@ public:
   }
 private:
   typename E::Ehdr ehdr_;
-  typename E::Phdr phdr_[64];
-  typename E::Shdr shdr_[256];
+  // Both point into the MemFile.
+  const typename E::Phdr* phdr_ = nullptr;
+  const typename E::Shdr* shdr_ = nullptr;
 
   std::map<std::string, Section<bits>*> sectionMap_;
   std::vector<Section<bits>*> sections_;
@@ -220,20 +454,43 @@ u32 hash(const char* str) {
   return rv;
 }
 
-std::map<char, std::set<std::string>> args;
+// Returns the values given with -<f>, in order.
+const std::set<std::string>& Arg(char f) {
+  static const std::set<std::string> none;
+  Args::const_iterator it = args->find(f);
+  return it == args->end() ? none : it->second;
+}
 
 bool HasFlag(const char* flag) {
-  return args['f'].find(flag) != args['f'].end();
+  return Arg('f').find(flag) != Arg('f').end();
+}
+
+// Returns the value of a -fname=value flag, or def if it is not given.
+const char* FlagValue(const char* name, const char* def) {
+  size_t l = strlen(name);
+  for (const std::string& f : Arg('f')) {
+    if (!strncmp(f.c_str(), name, l) && f[l] == '=') {
+      return f.c_str() + l + 1;
+    }
+  }
+  return def;
 }
 
 const char* FlagWithDefault(char f, const char* def) {
-  if (args[f].size() > 0) {
-    return args[f].begin()->c_str();
+  if (Arg(f).size() > 0) {
+    return Arg(f).begin()->c_str();
   } else {
     return def;
   }
 }
 
+// Reports the progress of the parameter search of a batch job.
+void JobProgress(void* ctx, int iteration, int iterations, int best) {
+  if (iteration % 10 == 0 || iteration == iterations) {
+    printf("[%s] Search %d/%d: %d bytes\n", (const char*)ctx, iteration, iterations, best);
+  }
+}
+
 void Invert(u8* data, u32 s) {
   for (u32 i = 0; i < s >> 1; ++i) {
     u8 t = data[i];
@@ -246,83 +503,208 @@ template<int bits> class Linker {
   typedef typename Elf<bits>::Sym Sym;
   typedef typename Elf<bits>::Rel Rel;
   typedef typename Elf<bits>::Rela Rela;
+  typedef typename Elf<bits>::Shdr Shdr;
 public:
-  bool Link(MemFile* o) {
-    Image<bits> obj;
-    if (!obj.Load(o)) {
-      return false;
+  ~Linker() {
+    for (Object* o : objects_) {
+      delete o;
+    }
+  }
+
+  bool Link(const std::vector<Input>& inputs) {
+    format_ = HasFlag("mix") ? MODEL_MIX : HasFlag("bytemodel") ? MODEL_BYTE : MODEL_BIT;
+    segments_ = HasFlag("segments") && format_ == MODEL_BIT;
+    if (HasFlag("segments") && !segments_) {
+      printf("-fsegments only works with the default model, ignoring it\n");
+    }
+    strides_ = HasFlag("strides") && format_ == MODEL_BIT;
+    if (HasFlag("strides") && !strides_) {
+      printf("-fstrides only works with the default model, ignoring it\n");
+    }
+
+    // Parse all objects in parallel, archive members included, so that we
+    // know which members define the symbols we need.
+    objects_.resize(inputs.size());
+    std::vector<char> loaded(inputs.size());
+    ParallelFor(inputs.size(), [&](u32 i) {
+      objects_[i] = new Object();
+      loaded[i] = objects_[i]->Load(inputs[i]);
+    });
+    for (u32 i = 0; i < inputs.size(); ++i) {
+      if (!loaded[i]) return false;
+    }
+
+    // Link all objects, then the archive members that define a symbol that
+    // is still undefined, until there are no more of those.
+    std::vector<Object*>& objects = linked_;
+    std::vector<bool> linked(inputs.size(), false);
+    for (u32 i = 0; i < inputs.size(); ++i) {
+      if (!inputs[i].archiveMember) {
+        if (!Add(objects_[i], &objects)) return false;
+        linked[i] = true;
+      }
+    }
+    for (bool more = true; more;) {
+      more = false;
+      for (u32 i = 0; i < inputs.size(); ++i) {
+        if (linked[i] || !objects_[i]->Defines(undefined_)) continue;
+        if (verbose)
+          printf("Linking archive member %s\n", objects_[i]->name.c_str());
+        if (!Add(objects_[i], &objects)) return false;
+        linked[i] = true;
+        more = true;
+      }
+    }
+
+    // Number the sections of all objects, and resolve every symbol to a
+    // section, a COMMON block or an import.
+    u32 sectionCount = 0;
+    for (Object* o : objects) {
+      o->firstSection = sectionCount;
+      sectionCount += o->image.SectionCount();
+    }
+    sectionObject_.resize(sectionCount);
+    for (Object* o : objects) {
+      for (u32 i = 0; i < o->image.SectionCount(); ++i) {
+        sectionObject_[o->firstSection + i] = o;
+      }
+    }
+    for (Object* o : objects) {
+      o->targets.resize(o->symbolCount);
+      for (u32 i = 0; i < o->symbolCount; ++i) {
+        Resolve(o, i, &o->targets[i]);
+      }
     }
 
     // Start off by finding the _start symbol.
-    Section<bits>* symtab = obj.GetSection(".symtab");
-    Sym* symbols = (Sym*)symtab->Data();
-    char* symbolNames = (char*)obj.GetSection(symtab->Hdr().sh_link)->Data();
-    u32 startSection = 0;
-    u32 startOffset = 0;
-    {
-      u32 sc = symtab->Size() / sizeof(Sym);
-      for (u32 i = 0; i < sc; ++i) {
-        // The ELF32_ST_XXX macros are identical to ELF64_ST_XXX.
-        if (!strcmp(&symbolNames[symbols[i].st_name], "_start")) {
-          startSection = symbols[i].st_shndx;
-          startOffset = symbols[i].st_value;
+    typename std::map<std::string, Definition>::iterator start = defined_.find("_start");
+    if (start == defined_.end()) {
+      printf("No _start symbol\n");
+      return false;
+    }
+    Target startTarget = start->second.object->targets[start->second.sym];
+    if (startTarget.kind != TARGET_SECTION) {
+      printf("_start is not in a section\n");
+      return false;
+    }
+
+    // Without garbage collection, every .text* section and every section
+    // that any relocation refers to is kept.
+    std::vector<bool> kept(sectionCount, false);
+    for (u32 g = 0; g < sectionCount; ++g) {
+      kept[g] = !strncmp(GetSection(g)->Name().c_str(), ".text", 5);
+    }
+    for (Object* o : objects) {
+      for (const std::vector<Reloc>& relocs : o->relocs) {
+        for (const Reloc& r : relocs) {
+          if (o->targets[r.sym].kind == TARGET_SECTION) kept[o->targets[r.sym].index] = true;
         }
       }
     }
-  
+
+    // Find the sections reachable from _start through relocations, and the
+    // imports and COMMON symbols they use. With -fnogc, the sections above
+    // are kept instead, with the imports and COMMON symbols of all sections.
     std::set<std::string> imports;
-    std::map<std::string, u32> sections;
-    std::map<u32, u32> common;
-    u32 commonOff = 0;
-    Section<bits>* bss = obj.GetSection(".bss");
-    sections[".text"] = 0;
-    if (bss) {
-      commonOff += bss->Size(); 
+    std::vector<bool> referenced(sectionCount, false);
+    std::vector<bool> commonUsed(commons_.size(), false);
+    bool gc = !HasFlag("nogc");
+    std::vector<bool> visited(sectionCount, false);
+    std::vector<u32> work(1, startTarget.index);
+    referenced[startTarget.index] = true;
+    for (u32 g = 0; g < sectionCount && !gc; ++g) {
+      referenced[g] = referenced[g] || kept[g];
+      work.push_back(g);
     }
-  
-    for (u32 i = 0; i < obj.SectionCount(); ++i) {
-      if (!strncmp(obj.GetSection(i)->Name().c_str(), ".rel.", 5) && bits == 32) {
-        if (bits != 32) { printf("Unsupported relocation: .rel with 64 bits\n"); return false; }
-        Section<bits>* rel = obj.GetSection(i);
-        Rel* tr = (Rel*)rel->Data();
-        for (u32 j = 0; j < rel->Size() / sizeof(Rel); ++j) {
-          u32 sym = ELF32_R_SYM(tr[j].r_info);
-          u32 type = ELF32_R_TYPE(tr[j].r_info);
-          if (symbols[sym].st_shndx && symbols[sym].st_shndx < obj.SectionCount()) {
-            if (obj.GetSection(symbols[sym].st_shndx)->Name() != ".bss") {
-              sections[obj.GetSection(symbols[sym].st_shndx)->Name()] = 0;
-            }
-          }
-          if (ELF32_ST_TYPE(symbols[sym].st_info) == STT_NOTYPE && ELF32_ST_BIND(symbols[sym].st_info) == STB_GLOBAL) {
-            imports.insert(&symbolNames[symbols[sym].st_name]);
-          }
-          if (symbols[sym].st_shndx == SHN_COMMON && common.find(symbols[sym].st_name) == common.end()) {
-            common[symbols[sym].st_name] = commonOff;
-            commonOff += symbols[sym].st_size;
-          }
+    while (!work.empty()) {
+      u32 g = work.back();
+      work.pop_back();
+      if (visited[g]) continue;
+      visited[g] = true;
+      Object* o = sectionObject_[g];
+      for (const Reloc& r : o->relocs[g - o->firstSection]) {
+        const Target& t = o->targets[r.sym];
+        if (t.kind == TARGET_SECTION) {
+          referenced[t.index] = true;
+          work.push_back(t.index);
+        } else if (t.kind == TARGET_IMPORT) {
+          imports.insert(t.name);
+        } else if (t.kind == TARGET_COMMON) {
+          commonUsed[t.index] = true;
         }
-      } else if (!strncmp(obj.GetSection(i)->Name().c_str(), ".rela.", 6)) {
-        if (bits != 64) { printf("Unsupported relocation: .rela with 32 bits\n"); return false; }
-        Section<bits>* rel = obj.GetSection(i);
-        Rela* tr = (Rela*)rel->Data();
-        for (u32 j = 0; j < rel->Size() / sizeof(Rela); ++j) {
-          u32 sym = ELF64_R_SYM(tr[j].r_info);
-          u32 type = ELF64_R_TYPE(tr[j].r_info);
-          if (symbols[sym].st_shndx && symbols[sym].st_shndx < obj.SectionCount()) {
-            if (obj.GetSection(symbols[sym].st_shndx)->Name() != ".bss") {
-              sections[obj.GetSection(symbols[sym].st_shndx)->Name()] = 0;
-            }
-          }
-          if (ELF32_ST_TYPE(symbols[sym].st_info) == STT_NOTYPE && ELF32_ST_BIND(symbols[sym].st_info) == STB_GLOBAL) {
-            imports.insert(&symbolNames[symbols[sym].st_name]);
+      }
+    }
+    if (gc) {
+      // Report the sections -fnogc would have kept that cannot be reached
+      // from _start.
+      u32 removed = 0;
+      for (u32 g = 0; g < sectionCount; ++g) {
+        Section<bits>* s = GetSection(g);
+        if (kept[g] && !referenced[g] && s->Size() && s->Hdr().sh_type != SHT_NOBITS) {
+          printf("Removed %-15s %6d bytes\n", s->Name().c_str(), s->Size());
+          removed += s->Size();
+        }
+      }
+      if (removed) {
+        printf("Removed %d bytes of sections unreachable from _start\n", removed);
+      }
+    }
+
+    // Fold read-only sections with identical contents and relocations into
+    // one. Repeat, since folding can make the relocations of other sections
+    // identical.
+    std::vector<u32> fold(sectionCount);
+    for (u32 g = 0; g < sectionCount; ++g) {
+      fold[g] = g;
+    }
+    if (!HasFlag("noicf")) {
+      u32 folded = 0;
+      for (bool more = true; more;) {
+        more = false;
+        std::map<std::string, u32> seen;
+        for (u32 g = 0; g < sectionCount; ++g) {
+          const Shdr& h = GetSection(g)->Hdr();
+          if (!referenced[g] || fold[g] != g || h.sh_type != SHT_PROGBITS || !h.sh_size ||
+              (h.sh_flags & (SHF_ALLOC | SHF_WRITE)) != SHF_ALLOC) {
+            continue;
           }
-          if (symbols[sym].st_shndx == SHN_COMMON && common.find(symbols[sym].st_name) == common.end()) {
-            common[symbols[sym].st_name] = commonOff;
-            commonOff += symbols[sym].st_size;
+          std::string key = FoldKey(sectionObject_[g], g - sectionObject_[g]->firstSection, fold);
+          std::map<std::string, u32>::iterator it = seen.find(key);
+          if (it == seen.end()) {
+            seen[key] = g;
+            continue;
           }
+          if (verbose)
+            printf("Folding %s (%s) into %s (%s)\n", GetSection(g)->Name().c_str(), sectionObject_[g]->name.c_str(),
+                   GetSection(it->second)->Name().c_str(), sectionObject_[it->second]->name.c_str());
+          fold[g] = it->second;
+          folded += h.sh_size;
+          more = true;
         }
       }
-    }  
+      if (folded) {
+        printf("Folded %d bytes of identical sections\n", folded);
+      }
+    }
+
+    // Place the .text sections first, then the others, each ordered by name.
+    // Sections without contents go after the image.
+    std::vector<u32> order, bssOrder;
+    for (u32 g = 0; g < sectionCount; ++g) {
+      if (!referenced[g] || fold[g] != g) continue;
+      if (GetSection(g)->Hdr().sh_type == SHT_NOBITS) {
+        bssOrder.push_back(g);
+      } else {
+        order.push_back(g);
+      }
+    }
+    std::stable_sort(order.begin(), order.end(), [&](u32 a, u32 b) {
+      const std::string& na = GetSection(a)->Name();
+      const std::string& nb = GetSection(b)->Name();
+      bool ta = !strncmp(na.c_str(), ".text", 5), tb = !strncmp(nb.c_str(), ".text", 5);
+      if (ta != tb) return ta;
+      return na < nb;
+    });
   
     const char* sig = "XXXX-Compressed code here-XXXX"; 
     u32 sz = 0;
@@ -332,16 +714,63 @@ public:
         break;
       }
     }
+    // The inverses of the branch and the data filters follow the import
+    // loader, each after its own signature, then the offsets of the number of
+    // contexts in the header.
+    const char* filterSig = "XXXX-Branch filter here-XXXX";
+    const char* dataFilterSig = "XXXX-Data filter here-XXXX";
+    const char* ccountSig = "XXXX-Context count here-XXXX";
+    u32 loaderEnd = HeaderSize(), dataFilterEnd = HeaderSize(), ccountEnd = HeaderSize();
+    for (const u8* p = Header() + sz; p < Header() + HeaderSize() - strlen(filterSig); ++p) {
+      if (!memcmp(p, filterSig, strlen(filterSig))) {
+        loaderEnd = p - Header();
+      } else if (!memcmp(p, dataFilterSig, strlen(dataFilterSig))) {
+        dataFilterEnd = p - Header();
+      } else if (!memcmp(p, ccountSig, strlen(ccountSig))) {
+        ccountEnd = p - Header();
+      }
+    }
+    if (loaderEnd > dataFilterEnd || dataFilterEnd > ccountEnd || ccountEnd == HeaderSize()) {
+      printf("Unexpected layout of the header, cannot use it\n");
+      return false;
+    }
+    const u8* ccountSites = &Header()[ccountEnd + strlen(ccountSig)];
+    u32 ccountSiteCount = (HeaderSize() - ccountEnd - strlen(ccountSig)) / 2;
+    const u8* unfilter = &Header()[loaderEnd + strlen(filterSig)];
+    u32 unfilterSize = dataFilterEnd - loaderEnd - strlen(filterSig);
+    bool branchFilter = HasFlag("branch");
+    if (branchFilter && (unfilterSize < 15 || unfilter[0] != 0xbf ||
+                         unfilter[5] != 0xbe || unfilter[unfilterSize - 5] != 0xe9)) {
+      printf("Unexpected branch filter code in header, cannot use it\n");
+      return false;
+    }
+    const u8* unfilterData = &Header()[dataFilterEnd + strlen(dataFilterSig)];
+    u32 unfilterDataSize = ccountEnd - dataFilterEnd - strlen(dataFilterSig);
+    bool dataFilter = !HasFlag("nodatafilter");
+    if (dataFilter && (unfilterDataSize < 15 || unfilterData[0] != 0xbb ||
+                       unfilterData[5] != 0xbd || unfilterData[unfilterDataSize - 5] != 0xe9)) {
+      printf("Unexpected data filter code in header, cannot use it\n");
+      return false;
+    }
     
-    u8* finalout = (u8*)malloc(65536);
-    u32 finalsize = HeaderSize() - strlen(sig) - sz;
+    // Room for the import loader, the jump table, all referenced sections
+    // and the inverses of the filters with the table of filtered sections.
+    u32 finalLimit = loaderEnd + unfilterSize + unfilterDataSize + 8 * (order.size() + 1) +
+                     (imports.size() + 1) * 14;
+    for (u32 g : order) {
+      finalLimit += GetSection(g)->Size();
+    }
+    u8* finalout = (u8*)malloc(finalLimit);
+    u32 finalsize = loaderEnd - strlen(sig) - sz;
     memcpy(finalout, &Header()[sz + strlen(sig)], finalsize);
     u32 tailoff = finalsize;
   
     u32 hashoff = finalsize;
+    std::map<std::string, u32> importSlots;  // Jump table slot of each import.
     for (const std::string& imp : imports) {
       if (verbose)
         printf("Import %-15s @ 0x%8.8x\n", imp.c_str(), finalsize);
+      importSlots.insert(std::make_pair(imp, (u32)importSlots.size()));
       if (bits == 32) {
         // 5 byte jump table entries:
         //  e9 xx xx xx xx jmp dword relative
@@ -364,213 +793,434 @@ public:
     for (int i = 0; i < (bits == 32 ? 5 : 14); ++i) {
       finalout[finalsize++] = 0;    
     }
-    // Put in entry point as relative 32-bit address. The assembly header ends
-    // with a relative jump.
-    *(u32*)&finalout[tailoff - 4] = finalsize + startOffset - tailoff;  
 
     // We now have a list of all referenced sections, locate them in the final
     // binary.
-    u32 textoff = 0;
-    for (auto& sec : sections) {
-      // Take all sections starting with ".text"
-      if (!strncmp(sec.first.c_str(), ".text", 5)) {
-        sec.second = finalsize;
-        textoff = finalsize;
-        printf("Section %-15s @ 0x%8.8x\n", sec.first.c_str(), finalsize);
-        finalsize += obj.GetSection(sec.first.c_str())->Size();
-      }
+    const u32 unplaced = 0xffffffff;
+    std::vector<u32> placed(sectionCount, unplaced);
+    u32 sectionsStart = finalsize;
+    for (u32 g : order) {
+      placed[g] = finalsize;
+      finalsize += GetSection(g)->Size();
     }
-    for (auto& sec : sections) {
-      // Take all sections not starting with ".text"
-      if (strncmp(sec.first.c_str(), ".text", 5)) {
-        sec.second = finalsize;
-        printf("Section %-15s @ 0x%8.8x\n", sec.first.c_str(), finalsize);
-        finalsize += obj.GetSection(sec.first.c_str())->Size();
+
+    // .bss and the other sections without contents follow the image, then
+    // COMMON. Sets the address of every symbol, without dest, and returns
+    // the end of memory used.
+    std::vector<u32> commonAddress(commons_.size(), 0);
+    u32 entrySize = bits == 32 ? 5 : 14;
+    auto PlaceRest = [&](u32 imageEnd, bool print) -> u32 {
+      u32 commonbase = (imageEnd + 255) & (~255); 
+      u32 memEnd = commonbase;
+      for (u32 g : bssOrder) {
+        u32 align = GetSection(g)->Hdr().sh_addralign;
+        if (align > 1) memEnd = (memEnd + align - 1) / align * align;
+        placed[g] = memEnd;
+        if (print) PrintPlacement(sectionObject_[g], GetSection(g), memEnd, objects.size() > 1);
+        memEnd += GetSection(g)->Hdr().sh_size;
+      }
+      for (u32 i = 0; i < commons_.size(); ++i) {
+        if (!commonUsed[i]) continue;
+        u32 align = commons_[i].align;
+        if (align > 1) memEnd = (memEnd + align - 1) / align * align;
+        commonAddress[i] = base + memEnd;
+        memEnd += commons_[i].size;
       }
+      for (u32 g = 0; g < sectionCount; ++g) {
+        placed[g] = placed[fold[g]];
+      }
+
+      // Resolve every symbol to its address, without dest, once.
+      for (Object* o : objects) {
+        o->address.assign(o->symbolCount, 0);
+        for (u32 i = 0; i < o->symbolCount; ++i) {
+          const Target& t = o->targets[i];
+          if (t.kind == TARGET_SECTION) {
+            if (placed[t.index] != unplaced) o->address[i] = base + placed[t.index] + t.value;
+          } else if (t.kind == TARGET_COMMON) {
+            o->address[i] = commonAddress[t.index];
+          } else if (t.kind == TARGET_IMPORT) {
+            std::map<std::string, u32>::iterator it = importSlots.find(t.name);
+            if (it != importSlots.end()) o->address[i] = hashoff + entrySize * it->second + base;
+          }
+        }
+      }
+      return memEnd;
+    };
+
+    // With -forder, search for an order of the sections that compresses
+    // better, with the addresses of everything else as they are now.
+    u32 orderRounds = HasFlag("order") ? 100 : atoi(FlagValue("order", "0"));
+    if (orderRounds) {
+      PlaceRest(finalsize, false);
+      SearchOrder(&order, finalout, sectionsStart, placed, fold, orderRounds);
+      finalsize = sectionsStart;
+      for (u32 g : order) {
+        placed[g] = finalsize;
+        finalsize += GetSection(g)->Size();
+      }
+    }
+    for (u32 g : order) {
+      PrintPlacement(sectionObject_[g], GetSection(g), placed[g], objects.size() > 1);
     }
-    for (auto& sec : sections) {
-      // Copy section contents.
-      memcpy(&finalout[sec.second], obj.GetSection(sec.first.c_str())->Data(), obj.GetSection(sec.first.c_str())->Size());
+    std::unique_ptr<Compressor> c(new Compressor());
+    c->SetStartupWeight(atof(FlagValue("startup-weight", "0")));
+    c->SetPrune(HasFlag("prune"));
+    c->SetStrides(strides_);
+    c->SetParallel(ParallelTrials, nullptr);
+    if (jobName) {
+      c->SetQuiet(true);
+      c->SetProgress(JobProgress, (void*)jobName);
+    }
+    ContextPrior prior;
+    if (FlagValue("prior", nullptr)) {
+      if (prior.Load(FlagValue("prior", nullptr))) {
+        c->SetPrior(&prior);
+      } else {
+        printf("Could not load the prior %s\n", FlagValue("prior", nullptr));
+      }
     }
 
-    u32 commonbase = (finalsize + 255) & (~255); 
-    if (bss) {
-      sections[".bss"] = commonbase;
-      printf("Section .bss            @ 0x%8.8x\n", commonbase);
-      commonbase += bss->Size();
+    // The branch filter covers the executable sections, the data filters the
+    // sections outside of them. The inverses run from the end of the image.
+    u32 codeStart = finalsize, codeEnd = 0;
+    for (u32 g : order) {
+      if (GetSection(g)->Hdr().sh_flags & SHF_EXECINSTR) {
+        codeStart = std::min(codeStart, placed[g]);
+        codeEnd = std::max(codeEnd, placed[g] + GetSection(g)->Size());
+      }
     }
+    // With -fsegments, the code up to here and the data after it may get
+    // parameters of their own.
+    u32 dataStart = codeEnd;
 
-    // Apply text relocations.
-    for (u32 i = 0; i < obj.SectionCount(); ++i) {
-      if (!strncmp(obj.GetSection(i)->Name().c_str(), ".rel.", 5)) {
-        const char* secName = obj.GetSection(i)->Name().c_str() + 4;
-        if (sections.find(secName) == sections.end()) continue;
-        if (verbose)
-          printf("Relocating %s\n", secName);
-        Section<bits>* rel = obj.GetSection(i);
-        Rel* tr = (Rel*)rel->Data();
-        u32 trc = rel->Size() / sizeof(Rel);
-        Sym* st = (Sym*)obj.GetSection(rel->Hdr().sh_link)->Data();
-        char* sn = (char*)obj.GetSection(obj.GetSection(rel->Hdr().sh_link)->Hdr().sh_link)->Data();
-        u32 secoff = sections[secName];
-        for (u32 j = 0; j < trc; ++j) {
-          u32 sym, type;
-          sym = ELF32_R_SYM(tr[j].r_info);
-          type = ELF32_R_TYPE(tr[j].r_info);
-          u32* off = (u32*)&finalout[secoff + tr[j].r_offset];
-          u32 b = 0;
-          const char* bind = "*";
-          switch (ELF32_ST_BIND(symbols[sym].st_info)) {
-          case STB_LOCAL: bind = "STB_LOCAL"; break;
-          case STB_GLOBAL: bind = "STB_GLOBAL"; break;
-          case STB_WEAK: bind = "STB_WEAK"; break;
-          }
-          const char* types = "*";
-          switch (ELF32_ST_TYPE(symbols[sym].st_info)) {
-          case STT_NOTYPE: types = "STT_NOTYPE"; break;
-          case STT_OBJECT: types = "STT_OBJECT"; break;
-          case STT_FUNC: types = "STT_FUNC"; break;
-          case STT_SECTION: types = "STT_SECTION"; break;
-          case STT_FILE: types = "STT_FILE"; break;
-          }
-          if (verbose)
-            printf(" %3d %4x %2d %3d %-20s %-10s %-10s %4x %4x %x %-s %x\n",
-              j, (u32)tr[j].r_offset, type, sym, &symbolNames[symbols[sym].st_name],
-              bind, types, (u32)symbols[sym].st_value, (u32)symbols[sym].st_size,
-              symbols[sym].st_other, symbols[sym].st_shndx < obj.SectionCount() ? obj.GetSection(symbols[sym].st_shndx)->Name().c_str() : "*",
-              symbols[sym].st_shndx);
-          u32 sec = st[sym].st_shndx;
-          if (sec && sec < obj.SectionCount()) {
-            b = base + sections[obj.GetSection(st[sym].st_shndx)->Name()] + symbols[sym].st_value; 
-          } else if (sec == SHN_COMMON) {
-            b = base + commonbase + common[st[sym].st_name];
-          } else if (sec == 0) {
-            u32 func = 0;
-            for (const std::string& imp : imports) {
-              if (imp == &symbolNames[symbols[sym].st_name]) break;
-              ++func;
-            }
-            b = hashoff + 5 * func + base;
-          } else {
-            printf("Unknown section %x\n", sec);
-          }
-          if (type == R_386_32) {
-            *off += b + 0x10000;
-          } else if (type == R_386_PC32) {
-            *off += b - tr[j].r_offset - secoff - base;
-          } else {
-            printf("Unknown type %d\n", type);
-          }
+    // Pick a filter for each data section, by compressing it alone with a
+    // small fixed set of contexts, with each filter. The inverse and the
+    // table entries have to be paid for from what they save.
+    std::vector<std::pair<u32, u32>> dataFilters;  // Section and filter.
+    if (dataFilter) {
+      CompressionParameters trial;
+      TrialParameters(&trial);
+      std::vector<u8> work, out;
+      auto TrialSize = [&](const u8* in, u32 size) -> int {
+        out.resize(2 * size + 1024);
+        int outSize = out.size();
+        return c->CompressSingle(&trial, (void*)in, size, out.data(), &outSize) ? outSize : out.size();
+      };
+      int saved = 0;
+      for (u32 g : order) {
+        Section<bits>* s = GetSection(g);
+        u32 count = s->Size() / 4;
+        if ((placed[g] < codeEnd && placed[g] + s->Size() > codeStart) || !s->Data() || count < 16 ||
+            count > (1 << 22)) {
+          continue;
         }
-      } else if (!strncmp(obj.GetSection(i)->Name().c_str(), ".rela.", 6)) {
-        const char* secName = obj.GetSection(i)->Name().c_str() + 5;
-        if (sections.find(secName) == sections.end()) continue;
-        if (verbose)
-          printf("Relocating %s\n",  secName);
-        Section<bits>* rel = obj.GetSection(i);
-        Rela* tr = (Rela*)rel->Data();
-        u32 trc = rel->Size() / sizeof(Rela);
-        Sym* st = (Sym*)obj.GetSection(rel->Hdr().sh_link)->Data();
-        char* sn = (char*)obj.GetSection(obj.GetSection(rel->Hdr().sh_link)->Hdr().sh_link)->Data();
-        u32 secoff = sections[secName];
-        for (u32 j = 0; j < trc; ++j) {
-          u32 sym, type;
-          sym = ELF64_R_SYM(tr[j].r_info);
-          type = ELF64_R_TYPE(tr[j].r_info);
-          u32* off = (u32*)&finalout[secoff + tr[j].r_offset];
-          u32 b = 0;
-          const char* bind = "*";
-          switch (ELF32_ST_BIND(symbols[sym].st_info)) {
-          case STB_LOCAL: bind = "STB_LOCAL"; break;
-          case STB_GLOBAL: bind = "STB_GLOBAL"; break;
-          case STB_WEAK: bind = "STB_WEAK"; break;
-          }
-          const char* types = "*";
-          switch (ELF32_ST_TYPE(symbols[sym].st_info)) {
-          case STT_NOTYPE: types = "STT_NOTYPE"; break;
-          case STT_OBJECT: types = "STT_OBJECT"; break;
-          case STT_FUNC: types = "STT_FUNC"; break;
-          case STT_SECTION: types = "STT_SECTION"; break;
-          case STT_FILE: types = "STT_FILE"; break;
-          }
-          if (verbose)
-            printf(" %3d %4x[%4x] %d %3d %-20s %-10s %-10s %4x %4x %x %-s %x\n",
-              j, (u32)tr[j].r_offset, (u32)(secoff + tr[j].r_offset), type, sym, &symbolNames[symbols[sym].st_name],
-              bind, types, (u32)symbols[sym].st_value, (u32)symbols[sym].st_size,
-              symbols[sym].st_other, symbols[sym].st_shndx < obj.SectionCount() ? obj.GetSection(symbols[sym].st_shndx)->Name().c_str() : "*",
-              symbols[sym].st_shndx);
-          u32 sec = st[sym].st_shndx;
-          if (sec && sec < obj.SectionCount()) {
-            b = base + sections[obj.GetSection(st[sym].st_shndx)->Name()] + symbols[sym].st_value; 
-          } else if (sec == SHN_COMMON) {
-            b = base + commonbase + common[st[sym].st_name];
-          } else if (sec == 0) {
-            u32 func = 0;
-            for (const std::string& imp : imports) {
-              if (imp == &symbolNames[symbols[sym].st_name]) break;
-              ++func;
-            }
-            b = hashoff + 14 * func + base;
-          } else {
-            printf("Unknown section %x\n", sec);
-          }
-          if (type == R_X86_64_64) {
-            *(u64*)off += b + 0x10000 + tr[j].r_addend;
-          } else if (type == R_X86_64_32) {
-            *off += b + 0x10000 + tr[j].r_addend;
-          } else if (type == R_X86_64_PC32) {
-            *off += b - tr[j].r_offset - secoff - base + tr[j].r_addend;
-          } else {
-            printf("Unknown type %d\n", type);
-          }
+        int sizes[4];
+        for (u32 f = 0; f < 4; ++f) {
+          work.assign(s->Data(), s->Data() + 4 * count);
+          DataFilter(work.data(), count, f);
+          sizes[f] = TrialSize(work.data(), work.size());
+        }
+        u32 best = 0;
+        for (u32 f = 1; f < 4; ++f) {
+          if (sizes[f] < sizes[best]) best = f;
         }
+        // A table entry takes 8 bytes, about half of them compress away.
+        if (sizes[0] - sizes[best] <= 4) continue;
+        static const char* filterNames[4] = { "none", "delta", "transpose", "delta+transpose" };
+        printf("Data filter %-15s %s, %d -> %d bytes\n", s->Name().c_str(), filterNames[best], sizes[0], sizes[best]);
+        dataFilters.push_back(std::make_pair(g, best));
+        saved += sizes[0] - sizes[best] - 4;
       }
+      int cost = TrialSize(unfilterData, unfilterDataSize) + 4;
+      if (!dataFilters.empty()) {
+        printf("Data filters save %d bytes, their inverse costs %d\n", saved, cost);
+      }
+      if (saved <= cost) dataFilters.clear();
+      dataFilter = !dataFilters.empty();
     }
-    
-    FILE* tmpout = fopen("test/tmp", "wb");
-    fwrite(finalout, finalsize, 1, tmpout);
-    fclose(tmpout);
-  
-    u8* bin = (u8*)malloc(65536);
-    u8* data = (u8*)malloc(65536);
-    int ds = 65536;
-    Compressor* c = new Compressor();
+
+    // Opcodes in the last 4 bytes are not checked, so that no displacement
+    // reaches past the code.
+    branchFilter = branchFilter && codeStart + 4 < codeEnd;
+    codeEnd -= 4;
+    u32 unfilterDataOff = finalsize;
+    u32 tableOff = unfilterDataOff + unfilterDataSize;
+    if (dataFilter) {
+      memcpy(&finalout[unfilterDataOff], unfilterData, unfilterDataSize);
+      finalsize = tableOff + 8 * (dataFilters.size() + 1);
+      memset(&finalout[tableOff], 0, finalsize - tableOff);
+    }
+    u32 unfilterOff = finalsize;
+    if (branchFilter) {
+      memcpy(&finalout[unfilterOff], unfilter, unfilterSize);
+      finalsize += unfilterSize;
+    }
+    // Put in entry point as relative 32-bit address. The assembly header ends
+    // with a relative jump, to the inverses of the filters if they are used.
+    u32 entryOff = placed[fold[startTarget.index]] + startTarget.value;
+    auto Jump = [&](u32 end, u32 target) { *(u32*)&finalout[end - 4] = target - end; };
+    auto ChainFilters = [&]() {
+      u32 next = entryOff;
+      if (branchFilter) {
+        Jump(unfilterOff + unfilterSize, next);
+        next = unfilterOff;
+      }
+      if (dataFilter) {
+        Jump(unfilterDataOff + unfilterDataSize, next);
+        next = unfilterDataOff;
+      }
+      Jump(tailoff, next);
+    };
+    ChainFilters();
+
+    u32 memEnd = PlaceRest(finalsize, true);
+
+    // The image is decompressed to dest, which has to be above the compressed
+    // data and the variables of the header that follow it. Start at 64 KB and
+    // move dest up, relocating and compressing again, if the compressed data
+    // does not fit below it.
+    // The import loader starts with mov ebp, base + 0x10000 + offset of the hashes.
+    u32 hashesAddress = *(u32*)&finalout[1];
+    int dsLimit = 2 * finalsize + 1024;
+    u8* data = (u8*)malloc(dsLimit + 8);
+    int ds = 0;
     CompressionParameters params;
     params.FromString(FlagWithDefault('c', ""));
-    c->Compress(&params, finalout, finalsize, data + 8, &ds);
+    params.format = format_;
+    for (int i = 0; i < params.contextCount; ++i) {
+      if (IsStride(params.contexts[i]) && (!strides_ || params.contexts[i] >> 1 > MAX_STRIDE)) {
+        printf("Context %2.2x needs -fstrides and a stride of at most %d\n", params.contexts[i], MAX_STRIDE);
+        return false;
+      }
+    }
+    // The parameters for the code, then those for the data if they pay for
+    // their entry in the segment table of the header.
+    std::vector<Segment> segments(1);
+    auto TableSize = [&]() -> u32 {
+      return segments_ ? 4 + (segments.size() - 1) * (4 + 2 * params.contextCount) : 0;
+    };
+    u32 dest = 0x10000;
+    u32 tables = 9;
+    for (bool searched = false;; searched = true) {
+      *(u32*)&finalout[1] = hashesAddress + dest - 0x10000;
+      for (u32 g : order) {
+        // Copy section contents, this is the only copy made of them.
+        Section<bits>* s = GetSection(g);
+        if (s->Data()) {
+          memcpy(&finalout[placed[g]], s->Data(), s->Size());
+        }
+      }
+
+      // Apply text relocations.
+      for (u32 g : order) {
+        if (verbose && !sectionObject_[g]->relocs[g - sectionObject_[g]->firstSection].empty())
+          printf("Relocating %s\n", GetSection(g)->Name().c_str());
+        if (!Relocate(finalout, g, placed[g], sectionObject_[g]->address, dest, verbose)) {
+          return false;
+        }
+      }
+
+      // The counter tables are 16 MB each, and start at 0x09000000 unless the
+      // image or its .bss reach that far.
+      tables = (base + dest + memEnd + 0xffffff) >> 24;
+      if (tables < 9) tables = 9;
+      if (dataFilter) {
+        *(u32*)&finalout[unfilterDataOff + 1] = base + dest + tableOff;  // mov ebx, imm32
+        *(u32*)&finalout[unfilterDataOff + 6] = tables << 24;  // mov ebp, imm32
+        for (u32 i = 0; i < dataFilters.size(); ++i) {
+          u32 g = dataFilters[i].first;
+          u32 count = GetSection(g)->Size() / 4;
+          *(u32*)&finalout[tableOff + 8 * i] = base + dest + placed[g];
+          *(u32*)&finalout[tableOff + 8 * i + 4] = count | dataFilters[i].second << 24;
+          DataFilter(&finalout[placed[g]], count, dataFilters[i].second);
+        }
+      }
+      if (branchFilter) {
+        *(u32*)&finalout[unfilterOff + 1] = base + dest + codeStart;  // mov edi, imm32
+        *(u32*)&finalout[unfilterOff + 6] = base + dest + codeEnd;  // mov esi, imm32
+        BranchFilter(finalout, codeStart, codeEnd, base + dest, false);
+      }
+    
+      // Search the parameters once, later passes only need to compress again.
+      // With -fdaemon=<socket>, the daemon searches them, if it can be reached.
+      ds = dsLimit;
+      bool compressed = false;
+      if (searched) {
+        compressed = c->CompressSegments(segments.data(), segments.size(), finalout, finalsize, data + 8, &ds);
+      } else if (FlagValue("daemon", nullptr)) {
+        std::string key = std::string(FlagWithDefault('o', "c.out")) + (bits == 32 ? ":32" : ":64");
+        DaemonOptions options;
+        options.startupWeight = atof(FlagValue("startup-weight", "0"));
+        options.prune = HasFlag("prune");
+        options.strides = strides_;
+        options.prior = prior.inputs ? &prior : nullptr;
+        compressed = DaemonCompress(FlagValue("daemon", nullptr), key.c_str(), options, &params, finalout, finalsize,
+                                    data + 8, &ds);
+        if (compressed) {
+          char buf[128];
+          params.ToString(buf);
+          printf("Daemon: %d bytes, Params: %s\n", ds, buf);
+        } else {
+          printf("Could not reach the daemon at %s, searching here\n", FlagValue("daemon", nullptr));
+          ds = dsLimit;
+        }
+      }
+      if (!searched && !compressed) {
+        compressed = c->Compress(&params, finalout, finalsize, data + 8, &ds);
+      }
+      if (!compressed) {
+        printf("Could not compress %d bytes\n", finalsize);
+        return false;
+      }
+      if (!searched) {
+        segments[0].params = params;
+      }
+      if (segments_ && !searched && dataStart > 0 && dataStart < unfilterDataOff) {
+        Segment split[2];
+        SearchSegments(params, finalout, finalsize, dataStart, prior.inputs ? &prior : nullptr, split);
+        u8* splitData = (u8*)malloc(dsLimit + 8);
+        int splitSize = dsLimit;
+        if (!c->CompressSegments(split, 2, finalout, finalsize, splitData + 8, &splitSize)) {
+          splitSize = dsLimit;
+        }
+        // Both count the parameters at the end of the image and the segment table.
+        int count = split[0].params.contextCount;
+        int single = ds + 2 * params.contextCount + TableSize();
+        int twice = splitSize + 2 * count + 4 + 4 + 2 * count;
+        char code[128], rest[128];
+        split[0].params.ToString(code);
+        split[1].params.ToString(rest);
+        printf("Segments: code %s, data %s: %d bytes, %d with one set\n", code, rest, twice, single);
+        if (twice < single) {
+          free(data);
+          data = splitData;
+          ds = splitSize;
+          params = split[0].params;
+          segments.assign(split, split + 2);
+        } else {
+          free(splitData);
+        }
+      }
+      if (branchFilter && !searched) {
+        // Compare against the image without the filter and its inverse, with
+        // the same parameters, and keep the filter only if it pays for itself.
+        u8* plain = (u8*)malloc(dsLimit + 8);
+        int plainSize = dsLimit;
+        BranchFilter(finalout, codeStart, codeEnd, base + dest, true);
+        branchFilter = false;
+        ChainFilters();
+        if (!c->CompressSegments(segments.data(), segments.size(), finalout, finalsize - unfilterSize, plain + 8,
+                                 &plainSize)) {
+          plainSize = dsLimit + 1;
+        }
+        printf("Branch filter: %d bytes, %d without, net gain %d bytes\n", ds, plainSize, plainSize - ds);
+        if (plainSize <= ds) {
+          finalsize -= unfilterSize;
+          free(data);
+          data = plain;
+          ds = plainSize;
+        } else {
+          free(plain);
+          branchFilter = true;
+          ChainFilters();
+          BranchFilter(finalout, codeStart, codeEnd, base + dest, false);
+        }
+      }
+      u32 needed = sz + TableSize() + ds + 4 + 2 * params.contextCount + VariableSize();
+      if (needed <= dest) break;
+      dest = (needed + 0xffff) & ~0xffff;
+      printf("Compressed data needs %d bytes, moving destination to 0x%x\n", needed, dest);
+    }
+
+    FILE* tmpout = jobName ? nullptr : fopen("test/tmp", "wb");
+    if (tmpout) {
+      fwrite(finalout, finalsize, 1, tmpout);
+      fclose(tmpout);
+    }
+
+    // The segment table goes between the header and the compressed data: the
+    // address of the first byte of each segment after the first, followed by
+    // its parameters, then an address of 0.
+    std::vector<u8> table;
+    for (u32 i = 1; segments_ && i < segments.size(); ++i) {
+      u32 address = base + dest + segments[i].start;
+      table.insert(table.end(), (u8*)&address, (u8*)&address + 4);
+      for (int m = 0; m < params.contextCount; ++m) {
+        table.push_back(segments[i].params.weights[m]);
+        table.push_back(segments[i].params.contexts[m]);
+      }
+    }
+    if (segments_) {
+      table.resize(table.size() + 4, 0);
+    }
+
+    // The decompressor reads the 8 bytes before the data as well.
     Invert(data + 8, ds);
-    memcpy(data, &Header()[sz - 8], 8);
+    std::vector<u8> lead(Header() + sz - 8, Header() + sz);
+    lead.insert(lead.end(), table.begin(), table.end());
+    memcpy(data, &lead[lead.size() - 8], 8);
   
     // Sanity check our compressed data by decompressing it again.
-    memset(bin, 0, 65536);
-    c->Decompress(&params, &data[8 + ds - 4], bin + 8, finalsize);
-    if (memcmp(finalout, bin + 8, finalsize)) {
+    u8* check = (u8*)malloc(finalsize + 8);
+    memset(check, 0, finalsize + 8);
+    c->DecompressSegments(segments.data(), segments.size(), &data[8 + ds - 4], check + 8, finalsize);
+    if (memcmp(finalout, check + 8, finalsize)) {
       printf("Decompression failed, first 10 different bytes\n");
       int c = 0;
-      for (int i = 0; i < finalsize; ++i) {
-        if (finalout[i] != bin[i + 8]) {
-          printf("%6x: %2.2x != %2.2x\n", i, finalout[i], bin[i + 8]);
+      for (u32 i = 0; i < finalsize; ++i) {
+        if (finalout[i] != check[i + 8]) {
+          printf("%6x: %2.2x != %2.2x\n", i, finalout[i], check[i + 8]);
           c++;
           if (c == 10) break;
         }
       }
     }
+    free(check);
+    u8* bin = (u8*)malloc(sz + table.size() + ds + 4 + 2 * params.contextCount);
     memcpy(bin, Header(), sz);
+    memcpy(&bin[sz], table.data(), table.size());
+    u32 stubSize = sz;
+    sz += table.size();
     memcpy(&bin[sz], data + 8, ds);
     sz += ds;
-    // Set pointer to last 4 bytes of compressed data in code. The address may
-    // need adjusting if the header assembly changes.
-    if (bits == 32) {
-      *(u32*)&bin[0xd8] = 0x08000000 + sz - 4;
-    } else {
-      *(u32*)&bin[0x169] = 0x08000000 + sz - 4;
+    // Patch the entry code: the pointer to the last 4 bytes of compressed
+    // data, dest and the top byte of the first counter table. The offset may
+    // need adjusting if the header assembly changes, so check the opcodes.
+    u32 entry = bits == 32 ? 0xd7 : 0x168;
+    if (bin[entry] != 0xbd || bin[entry + 5] != 0xbf || bin[entry + 20] != 0xb2) {
+      printf("Unexpected entry code in header, cannot patch it\n");
+      return false;
+    }
+    *(u32*)&bin[entry + 1] = base + sz - 4;  // mov ebp, imm32
+    *(u32*)&bin[entry + 6] = base + dest;  // mov edi, imm32
+    bin[entry + 21] = tables;  // mov dl, imm8
+    // One 16 MB table per context, and one more for the tables of the mixer.
+    u64 memsz = ((u64)(tables + params.contextCount + (format_ == MODEL_MIX)) << 24) - base;
+    if (memsz > 161 * 1024 * 1024) {
+      if (bits == 32) {
+        *(u32*)&bin[0x80] = memsz;
+      } else {
+        *(u64*)&bin[0xd0] = memsz;
+      }
     }
     // Place size of decompressed data in bits at end of image.
     *(u32*)&bin[sz] = finalsize * 8;
-    // Add compression parameters to end of image.
-    memcpy(&bin[sz + 4], params.weights, params.contextCount);
-    memcpy(&bin[sz + 4 + params.contextCount], params.contexts, params.contextCount);
+    // Add compression parameters to end of image, the weight and mask of each
+    // context, and patch the number of contexts into the header.
+    for (int i = 0; i < params.contextCount; ++i) {
+      bin[sz + 4 + 2 * i] = params.weights[i];
+      bin[sz + 5 + 2 * i] = params.contexts[i];
+    }
     sz += 4 + 2 * params.contextCount;
+    for (u32 i = 0; i < ccountSiteCount; ++i) {
+      u16 site = *(const u16*)&ccountSites[2 * i];
+      if (site <= entry || site >= stubSize || bin[site - 1] != 0xb1) {  // mov cl, imm8
+        printf("Unexpected context count code in header, cannot patch it\n");
+        return false;
+      }
+      bin[site] = params.contextCount;
+    }
     // Place file size in ELF header.
     if (bits == 32) {
       *(u32*)&bin[0x7c] = sz;
@@ -582,46 +1232,704 @@ public:
     fwrite(bin, sz, 1, fptr);
     fclose(fptr);
     printf("Wrote %d bytes\n", sz);
+    free(bin);
+    free(data);
+    free(finalout);
+    return true;
   }
 private:
+  // A relocation from a .rel or .rela section. The addend of .rel is always
+  // 0, since it is already in the section contents.
+  struct Reloc {
+    u32 offset;
+    u32 sym;
+    u32 type;
+    s64 addend;
+  };
+
+  // What a relocation type does, as far as elfling is concerned.
+  enum RelocKind {
+    RELOC_ABS32,  // S + A, 32 bits
+    RELOC_ABS64,  // S + A, 64 bits
+    RELOC_PC32,  // S + A - P, 32 bits
+    RELOC_UNKNOWN,
+  };
+
+  static void BranchFilter(u8* data, u32 start, u32 end, u32 address, bool inverse);
+  static void DataFilter(u8* data, u32 count, u32 filter);
+  void TrialParameters(CompressionParameters* params);
+  void SearchSegments(const CompressionParameters& params, const u8* image, u32 size, u32 split,
+                      const ContextPrior* prior, Segment* segments);
+  Section<bits>* GetSection(u32 g) { return sectionObject_[g]->image.GetSection(g - sectionObject_[g]->firstSection); }
+  bool Relocate(u8* image, u32 g, u32 offset, const std::vector<u32>& address, u32 dest, bool print);
+  void SearchOrder(std::vector<u32>* order, const u8* prefix, u32 start, const std::vector<u32>& placed,
+                   const std::vector<u32>& fold, u32 rounds);
   inline const u8* Header();
   inline u32 HeaderSize();
+  static inline u32 RelocSym(u64 info);
+  static inline u32 RelocType(u64 info);
+  static inline RelocKind RelocKindOf(u32 type);
+
+  // Bytes the header keeps for its variables after the compressed data, more
+  // with MODEL_MIX for the weights and inputs of the mixer. Either way, at
+  // least MAX_STRIDE of them stay zero, for the stride contexts to read
+  // before the output.
+  u32 VariableSize() const { return format_ == MODEL_MIX ? 384 : 256; }
+
+  // What a symbol resolves to, after looking up globals in all objects.
+  enum TargetKind { TARGET_NONE, TARGET_SECTION, TARGET_COMMON, TARGET_IMPORT };
+  struct Target {
+    TargetKind kind;
+    u32 index;  // Section among all objects, or COMMON block.
+    u64 value;  // Offset in the section.
+    const char* name;  // Name of the symbol, used for imports.
+  };
+
+  // One object, with its relocations gathered per section they apply to.
+  struct Object {
+    std::string name;
+    Image<bits> image;
+    const Sym* symbols = nullptr;
+    const char* symbolNames = nullptr;
+    u32 symbolCount = 0;
+    u32 index = 0;  // Among the linked objects.
+    u32 firstSection = 0;  // Index of section 0 among the sections of all objects.
+    std::vector<std::vector<Reloc>> relocs;
+    std::vector<Target> targets;  // Per symbol.
+    std::vector<u32> address;  // Per symbol, without dest.
+
+    bool Load(const Input& in);
+    bool Defines(const std::set<std::string>& names) const;
+  };
+
+  // The object and symbol a global name resolves to. Rank 3 is a normal
+  // definition, 2 a COMMON block and 1 a weak definition.
+  struct Definition {
+    Object* object;
+    u32 sym;
+    int rank;
+  };
+
+  struct Common {
+    u64 size;
+    u64 align;
+  };
+
+  bool Add(Object* o, std::vector<Object*>* objects);
+  void Resolve(Object* o, u32 sym, Target* t);
+  std::string FoldKey(Object* o, u32 section, const std::vector<u32>& fold);
+  static void PrintPlacement(Object* o, Section<bits>* s, u32 offset, bool withObject);
+
+  std::vector<Object*> objects_;  // All parsed objects, linked or not.
+  std::vector<Object*> linked_;  // The objects that are linked.
+  std::vector<Object*> sectionObject_;  // The object of each section, numbered across linked objects.
+  std::map<std::string, Definition> defined_;
+  std::set<std::string> undefined_;
+  std::vector<Common> commons_;
+  std::map<std::string, u32> commonIndex_;
+
+  int format_ = MODEL_BIT;  // Model of the header and compressor, MODEL_BYTE or MODEL_MIX by flag.
+  bool segments_ = false;  // Header that switches parameters between code and data, by flag.
+  bool strides_ = false;  // Header that takes stride contexts, by flag.
 };
 
-template<> const u8* Linker<32>::Header() { return header32; }
-template<> const u8* Linker<64>::Header() { return header64; }
-template<> u32 Linker<32>::HeaderSize() { return sizeof(header32); }
-template<> u32 Linker<64>::HeaderSize() { return sizeof(header64); }
+template<int bits> bool Linker<bits>::Object::Load(const Input& in) {
+  name = in.name;
+  if (!image.Load(&in)) {
+    return false;
+  }
+  Section<bits>* symtab = image.GetSection(".symtab");
+  if (!symtab) {
+    printf("No symbol table in %s\n", in.Name());
+    return false;
+  }
+  symbols = (const Sym*)symtab->Data();
+  symbolNames = (const char*)image.GetSection(symtab->Hdr().sh_link)->Data();
+  symbolCount = symtab->Size() / sizeof(Sym);
 
-int main(int argc, char* argv[]) {
-  for (int i = 1; i < argc; ++i) {
-    if (argv[i][0] == '-') {
-      if (argv[i][1]) {
-        args[argv[i][1]].insert(std::string(&argv[i][2]));
+  // Gather the relocations of .rel and .rela sections into one list per
+  // section they apply to.
+  u32 sectionCount = image.SectionCount();
+  relocs.resize(sectionCount);
+  for (u32 i = 0; i < sectionCount; ++i) {
+    Section<bits>* rel = image.GetSection(i);
+    u32 type = rel->Hdr().sh_type;
+    if (type != SHT_REL && type != SHT_RELA) continue;
+    if (type == SHT_REL && bits != 32) { printf("Unsupported relocation: .rel with 64 bits\n"); return false; }
+    if (type == SHT_RELA && bits != 64) { printf("Unsupported relocation: .rela with 32 bits\n"); return false; }
+    u32 target = rel->Hdr().sh_info;
+    if (target >= sectionCount) continue;
+    if (type == SHT_REL) {
+      const Rel* tr = (const Rel*)rel->Data();
+      for (u32 j = 0; j < rel->Size() / sizeof(Rel); ++j) {
+        Reloc r = { (u32)tr[j].r_offset, RelocSym(tr[j].r_info), RelocType(tr[j].r_info), 0 };
+        relocs[target].push_back(r);
+      }
+    } else {
+      const Rela* tr = (const Rela*)rel->Data();
+      for (u32 j = 0; j < rel->Size() / sizeof(Rela); ++j) {
+        Reloc r = { (u32)tr[j].r_offset, RelocSym(tr[j].r_info), RelocType(tr[j].r_info), (s64)tr[j].r_addend };
+        relocs[target].push_back(r);
+      }
+    }
+    for (const Reloc& r : relocs[target]) {
+      if (r.sym >= symbolCount) {
+        printf("Relocation to symbol %d out of range in %s\n", r.sym, in.Name());
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Returns whether the object defines one of names, not counting COMMON.
+template<int bits> bool Linker<bits>::Object::Defines(const std::set<std::string>& names) const {
+  for (u32 i = 1; i < symbolCount; ++i) {
+    if (ELF32_ST_BIND(symbols[i].st_info) != STB_LOCAL && symbols[i].st_shndx != SHN_UNDEF &&
+        symbols[i].st_shndx != SHN_COMMON && names.count(&symbolNames[symbols[i].st_name])) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Adds the global symbols of o to the symbol table. Fails if a symbol is
+// defined twice.
+template<int bits> bool Linker<bits>::Add(Object* o, std::vector<Object*>* objects) {
+  o->index = objects->size();
+  objects->push_back(o);
+  for (u32 i = 1; i < o->symbolCount; ++i) {
+    const Sym& s = o->symbols[i];
+    if (ELF32_ST_BIND(s.st_info) == STB_LOCAL) continue;
+    std::string name = &o->symbolNames[s.st_name];
+    if (s.st_shndx == SHN_UNDEF) {
+      if (defined_.find(name) == defined_.end()) undefined_.insert(name);
+      continue;
+    }
+    int rank = 3;
+    if (s.st_shndx == SHN_COMMON) {
+      // COMMON blocks of the same name become one, as large as the largest.
+      rank = 2;
+      std::map<std::string, u32>::iterator it = commonIndex_.find(name);
+      if (it == commonIndex_.end()) {
+        commonIndex_[name] = commons_.size();
+        Common c = { (u64)s.st_size, (u64)s.st_value };  // st_value holds the alignment.
+        commons_.push_back(c);
+      } else {
+        Common& c = commons_[it->second];
+        if (s.st_size > c.size) c.size = s.st_size;
+        if (s.st_value > c.align) c.align = s.st_value;
+      }
+    } else if (ELF32_ST_BIND(s.st_info) == STB_WEAK) {
+      rank = 1;
+    }
+    Definition d = { o, i, rank };
+    typename std::map<std::string, Definition>::iterator it = defined_.find(name);
+    if (it == defined_.end()) {
+      defined_[name] = d;
+    } else if (rank == 3 && it->second.rank == 3) {
+      printf("%s is defined in both %s and %s\n", name.c_str(), it->second.object->name.c_str(), o->name.c_str());
+      return false;
+    } else if (rank > it->second.rank) {
+      it->second = d;
+    }
+    undefined_.erase(name);
+  }
+  return true;
+}
+
+template<int bits> void Linker<bits>::Resolve(Object* o, u32 sym, Target* t) {
+  const Sym* s = &o->symbols[sym];
+  t->kind = TARGET_NONE;
+  t->index = 0;
+  t->value = 0;
+  t->name = &o->symbolNames[s->st_name];
+  if (ELF32_ST_BIND(s->st_info) != STB_LOCAL) {
+    typename std::map<std::string, Definition>::iterator it = defined_.find(t->name);
+    if (it == defined_.end()) {
+      if (s->st_shndx == SHN_UNDEF) t->kind = TARGET_IMPORT;
+      return;
+    }
+    o = it->second.object;
+    s = &o->symbols[it->second.sym];
+  }
+  if (s->st_shndx == SHN_COMMON) {
+    t->kind = TARGET_COMMON;
+    t->index = commonIndex_[t->name];
+  } else if (s->st_shndx && s->st_shndx < o->image.SectionCount()) {
+    t->kind = TARGET_SECTION;
+    t->index = o->firstSection + s->st_shndx;
+    t->value = s->st_value;
+  }
+}
+
+// Returns the contents and relocations of a section, with the targets of
+// the relocations after folding, so that equal keys can share one copy.
+template<int bits> std::string Linker<bits>::FoldKey(Object* o, u32 section, const std::vector<u32>& fold) {
+  Section<bits>* s = o->image.GetSection(section);
+  char buf[128];
+  snprintf(buf, sizeof(buf), "%x:%llx:", s->Size(), (u64)s->Hdr().sh_addralign);
+  std::string key = buf;
+  key.append((const char*)s->Data(), s->Size());
+  for (const Reloc& r : o->relocs[section]) {
+    const Target& t = o->targets[r.sym];
+    snprintf(buf, sizeof(buf), ":%x:%x:%llx:%d:%x:%llx", r.offset, r.type, (u64)r.addend, t.kind,
+             t.kind == TARGET_SECTION ? fold[t.index] : t.index, (u64)t.value);
+    key += buf;
+    if (t.kind == TARGET_IMPORT) key += t.name;
+  }
+  return key;
+}
+
+// Turns the rel32 of call, jmp and jcc in [start, end) into absolute targets,
+// or back if inverse is set, where address is where data is loaded. Checks
+// the same bytes as the inverse in the header, which never changes them, so
+// the inverse finds the same displacements.
+template<int bits> void Linker<bits>::BranchFilter(u8* data, u32 start, u32 end, u32 address, bool inverse) {
+  u8 prev = 0;
+  for (u32 i = start; i < end;) {
+    u8 op = data[i++];
+    if ((op & 0xfe) == 0xe8 || (prev == 0x0f && (op & 0xf0) == 0x80)) {
+      i += 4;
+      if (inverse) {
+        *(u32*)&data[i - 4] -= address + i;
+      } else {
+        *(u32*)&data[i - 4] += address + i;
+      }
+    }
+    prev = op;
+  }
+}
+
+// Delta codes count 4-byte elements if bit 0 of filter is set, then stores
+// their bytes as 4 planes if bit 1 is set. The header undoes both.
+template<int bits> void Linker<bits>::DataFilter(u8* data, u32 count, u32 filter) {
+  if (filter & 1) {
+    for (u32 i = count - 1; i > 0; --i) {
+      *(u32*)&data[4 * i] -= *(u32*)&data[4 * i - 4];
+    }
+  }
+  if (filter & 2) {
+    std::vector<u8> planes(4 * count);
+    for (u32 i = 0; i < count; ++i) {
+      for (u32 k = 0; k < 4; ++k) {
+        planes[k * count + i] = data[4 * i + k];
+      }
+    }
+    memcpy(data, planes.data(), 4 * count);
+  }
+}
+
+// A small fixed set of contexts, for quick trial compressions.
+template<int bits> void Linker<bits>::TrialParameters(CompressionParameters* params) {
+  static const u8 trialContexts[4] = { 0x01, 0x03, 0x08, 0x0f };
+  params->format = format_;
+  params->contextCount = 4;
+  for (int i = 0; i < 4; ++i) {
+    params->contexts[i] = trialContexts[i];
+    params->weights[i] = 16;
+  }
+}
+
+// Searches parameters for the image up to split and for the rest at the same
+// time, each on a thread of its own, starting from params. Each search has a
+// Compressor of its own, which LinkMemory counts. The sets are padded to the
+// same number of contexts with contexts of weight 0, since the header has one
+// count for all of them.
+template<int bits> void Linker<bits>::SearchSegments(const CompressionParameters& params, const u8* image, u32 size,
+                                                    u32 split, const ContextPrior* prior, Segment* segments) {
+  const Args* jobArgs = args;
+  bool jobVerbose = verbose;
+  const char* job = jobName;
+  std::thread threads[2];
+  for (int i = 0; i < 2; ++i) {
+    segments[i].start = i ? split : 0;
+    segments[i].params = params;
+    threads[i] = std::thread([&, i]() {
+      args = jobArgs;
+      verbose = jobVerbose;
+      jobName = job;
+      std::unique_ptr<Compressor> c(new Compressor());
+      c->SetStartupWeight(atof(FlagValue("startup-weight", "0")));
+      c->SetParallel(ParallelTrials, nullptr);
+      c->SetPrior(prior);
+      c->SetStrides(strides_);
+      c->SetQuiet(true);
+      u32 start = segments[i].start, end = i ? size : split;
+      c->Optimize(&segments[i].params, image + start, end - start, nullptr, nullptr, nullptr);
+    });
+  }
+  for (std::thread& t : threads) {
+    t.join();
+  }
+  int count = std::max(segments[0].params.contextCount, segments[1].params.contextCount);
+  for (int i = 0; i < 2; ++i) {
+    CompressionParameters* p = &segments[i].params;
+    while (p->contextCount < count) {
+      p->weights[p->contextCount] = 0;
+      p->contexts[p->contextCount++] = 1;
+    }
+  }
+}
+
+// Applies the relocations of section g, at offset in image, with the symbol
+// addresses of its object. Fails on relocation types elfling does not know.
+template<int bits> bool Linker<bits>::Relocate(u8* image, u32 g, u32 offset, const std::vector<u32>& address,
+                                               u32 dest, bool print) {
+  Object* o = sectionObject_[g];
+  for (const Reloc& r : o->relocs[g - o->firstSection]) {
+    if (print)
+      printf(" %4x[%4x] %2d %3d %-20s %4x\n", r.offset, offset + r.offset, r.type, r.sym,
+             &o->symbolNames[o->symbols[r.sym].st_name], address[r.sym]);
+    u8* off = &image[offset + r.offset];
+    // S and P are relative to base, A is the addend.
+    u32 s = address[r.sym];
+    u32 p = base + offset + r.offset;
+    switch (RelocKindOf(r.type)) {
+    case RELOC_ABS32:
+      *(u32*)off += s + dest + r.addend;
+      break;
+    case RELOC_ABS64:
+      *(u64*)off += s + dest + r.addend;
+      break;
+    case RELOC_PC32:
+      *(u32*)off += s - p + r.addend;
+      break;
+    default:
+      printf("Unknown type %d\n", r.type);
+      return false;
+    }
+  }
+  return true;
+}
+
+// Searches for an order of the sections that compresses better, by moving
+// or swapping sections at random and keeping the best of each round. The
+// code stays in front of the data. Candidates are compressed in parallel,
+// with the image placed at the default dest, after prefix.
+template<int bits> void Linker<bits>::SearchOrder(std::vector<u32>* order, const u8* prefix, u32 start,
+                                                  const std::vector<u32>& placed, const std::vector<u32>& fold,
+                                                  u32 rounds) {
+  u32 codeCount = 0;
+  while (codeCount < order->size() && (GetSection((*order)[codeCount])->Hdr().sh_flags & SHF_EXECINSTR)) {
+    ++codeCount;
+  }
+  u32 size = start;
+  for (u32 g : *order) {
+    size += GetSection(g)->Size();
+  }
+  CompressionParameters trial;
+  TrialParameters(&trial);
+
+  // One set of buffers per candidate of a round, they are compressed on the pool.
+  u32 candidates = std::max(1u, std::min(pool.ThreadCount(), 8u));
+  struct Candidate {
+    std::vector<u32> order;
+    std::vector<u32> placed;
+    std::vector<std::vector<u32>> address;
+    std::vector<u8> image;
+    int size;
+  };
+  std::vector<Candidate> cand(candidates);
+  for (Candidate& c : cand) {
+    c.placed = placed;
+    c.address.resize(linked_.size());
+    c.image.resize(size);
+  }
+  auto Evaluate = [&](Candidate& c) {
+    u32 offset = start;
+    for (u32 g : c.order) {
+      c.placed[g] = offset;
+      offset += GetSection(g)->Size();
+    }
+    memcpy(c.image.data(), prefix, start);
+    for (u32 g : c.order) {
+      if (GetSection(g)->Data()) {
+        memcpy(&c.image[c.placed[g]], GetSection(g)->Data(), GetSection(g)->Size());
+      }
+    }
+    for (Object* o : linked_) {
+      std::vector<u32>& address = c.address[o->index];
+      address = o->address;
+      for (u32 i = 0; i < o->symbolCount; ++i) {
+        const Target& t = o->targets[i];
+        if (t.kind == TARGET_SECTION && placed[fold[t.index]] != 0xffffffff) {
+          address[i] = base + c.placed[fold[t.index]] + t.value;
+        }
+      }
+    }
+    for (u32 g : c.order) {
+      Relocate(c.image.data(), g, c.placed[g], c.address[sectionObject_[g]->index], 0x10000, false);
+    }
+    c.size = ThreadCompressor()->TrialSize(&trial, c.image.data(), size);
+  };
+
+  cand[0].order = *order;
+  Evaluate(cand[0]);
+  int initial = cand[0].size, best = initial;
+  for (u32 round = 0; round < rounds; ++round) {
+    for (Candidate& c : cand) {
+      c.order = *order;
+      // Pick the code or the data, whichever has sections to move.
+      u32 first = 0, count = codeCount;
+      if (count < 2 || (order->size() - codeCount >= 2 && rand() % 2)) {
+        first = codeCount;
+        count = order->size() - codeCount;
+      }
+      if (count < 2) continue;
+      u32 a = first + rand() % count, b = first + rand() % count;
+      if (rand() % 2) {
+        std::swap(c.order[a], c.order[b]);
+      } else {
+        u32 g = c.order[a];
+        c.order.erase(c.order.begin() + a);
+        c.order.insert(c.order.begin() + b, g);
+      }
+    }
+    ParallelFor(candidates, [&](u32 i) { Evaluate(cand[i]); });
+    for (Candidate& c : cand) {
+      if (c.size < best) {
+        best = c.size;
+        *order = c.order;
+      }
+    }
+    if (verbose)
+      printf("Order round %d: %d bytes\n", round, best);
+  }
+  printf("Section order: %d -> %d bytes in %d rounds of %d\n", initial, best, rounds, candidates);
+}
+
+template<int bits> void Linker<bits>::PrintPlacement(Object* o, Section<bits>* s, u32 offset, bool withObject) {
+  if (withObject) {
+    printf("Section %-15s @ 0x%8.8x %s\n", s->Name().c_str(), offset, o->name.c_str());
+  } else {
+    printf("Section %-15s @ 0x%8.8x\n", s->Name().c_str(), offset);
+  }
+}
+
+template<> const u8* Linker<32>::Header() {
+  if (segments_) return strides_ ? header32st : header32s;
+  if (strides_) return header32t;
+  return format_ == MODEL_BYTE ? header32b : format_ == MODEL_MIX ? header32m : header32;
+}
+template<> const u8* Linker<64>::Header() {
+  if (segments_) return strides_ ? header64st : header64s;
+  if (strides_) return header64t;
+  return format_ == MODEL_BYTE ? header64b : format_ == MODEL_MIX ? header64m : header64;
+}
+template<> u32 Linker<32>::HeaderSize() {
+  if (segments_) return strides_ ? sizeof(header32st) : sizeof(header32s);
+  if (strides_) return sizeof(header32t);
+  return format_ == MODEL_BYTE ? sizeof(header32b) : format_ == MODEL_MIX ? sizeof(header32m) : sizeof(header32);
+}
+template<> u32 Linker<64>::HeaderSize() {
+  if (segments_) return strides_ ? sizeof(header64st) : sizeof(header64s);
+  if (strides_) return sizeof(header64t);
+  return format_ == MODEL_BYTE ? sizeof(header64b) : format_ == MODEL_MIX ? sizeof(header64m) : sizeof(header64);
+}
+template<> u32 Linker<32>::RelocSym(u64 info) { return ELF32_R_SYM(info); }
+template<> u32 Linker<64>::RelocSym(u64 info) { return ELF64_R_SYM(info); }
+template<> u32 Linker<32>::RelocType(u64 info) { return ELF32_R_TYPE(info); }
+template<> u32 Linker<64>::RelocType(u64 info) { return ELF64_R_TYPE(info); }
+
+template<> Linker<32>::RelocKind Linker<32>::RelocKindOf(u32 type) {
+  switch (type) {
+  case R_386_32: return RELOC_ABS32;
+  case R_386_PC32: return RELOC_PC32;
+  case R_386_PLT32: return RELOC_PC32;  // Calls to imports go through our jump table anyway.
+  }
+  return RELOC_UNKNOWN;
+}
+
+template<> Linker<64>::RelocKind Linker<64>::RelocKindOf(u32 type) {
+  switch (type) {
+  case R_X86_64_64: return RELOC_ABS64;
+  case R_X86_64_32: return RELOC_ABS32;
+  case R_X86_64_32S: return RELOC_ABS32;  // The image is below 2 GB, so sign extension does not matter.
+  case R_X86_64_PC32: return RELOC_PC32;
+  case R_X86_64_PLT32: return RELOC_PC32;
+  }
+  return RELOC_UNKNOWN;
+}
+
+// Adds the arguments in argv to a, and the names of the objects to inputs.
+void ParseArgs(const std::vector<std::string>& argv, Args* a, std::vector<std::string>* inputs) {
+  for (const std::string& arg : argv) {
+    if (arg[0] == '-') {
+      if (arg.size() > 1) {
+        (*a)[arg[1]].insert(arg.substr(2));
       }
     } else {
-      args['i'].insert(argv[i]);
+      (*a)['i'].insert(arg);
+      inputs->push_back(arg);
     }
   }
+}
+
+// Links the objects in inputNames, with the arguments in args.
+bool LinkFiles(const std::vector<std::string>& inputNames) {
   verbose = HasFlag("verbose");
 
-  if (args['i'].size() == 0) { printf("No obj specified\n"); return 1; }
-  const char* fn = args['i'].begin()->c_str();
-  MemFile o;
-  if (!o.Load(fn)) {
-    return 0;
+  if (inputNames.empty()) { printf("No obj specified\n"); return false; }
+  // Objects are linked as a whole, archives only for the members that define
+  // a symbol that is needed.
+  std::vector<std::unique_ptr<MemFile>> files;
+  std::vector<Input> inputs;
+  for (const std::string& fn : inputNames) {
+    MemFile* f = new MemFile();
+    files.push_back(std::unique_ptr<MemFile>(f));
+    if (!f->Load(fn.c_str())) {
+      return false;
+    }
+    if (f->Size() >= 8 && !memcmp(f->Data(), "!<arch>\n", 8)) {
+      if (!ReadArchive(f, &inputs)) return false;
+    } else {
+      Input in = { fn, f->Data(), f->Size(), false };
+      inputs.push_back(in);
+    }
+  }
+  for (const Input& in : inputs) {
+    if (in.size < 20 || *(u16*)&in.data[18] != *(u16*)&inputs[0].data[18]) {
+      printf("%s is not an object for the same architecture as %s\n", in.Name(), inputs[0].Name());
+      return false;
+    }
   }
-  u16 arch = *(u16*)&o.Data()[18];
+  u16 arch = *(u16*)&inputs[0].data[18];
   if (arch == 3) {
     printf("Arch: i386\n");
     Linker<32> l;
-    l.Link(&o);
+    return l.Link(inputs);
   } else if (arch == 62) {    
     printf("Arch: x86_64\n");
     Linker<64> l;
-    l.Link(&o);
+    return l.Link(inputs);
+  }
+  printf("Cannot handle architecture in %s (arch = %2.2x)\n", inputs[0].Name(), arch);
+  return false;
+}
+
+// Memory a link with the current args holds apart from the pool: its
+// Compressor, two more while -fsegments searches code and data at once, and a
+// few copies of the image, which is about as large as the objects.
+u64 LinkMemory(const std::vector<std::string>& inputNames) {
+  u64 size = (HasFlag("segments") ? 3 : 1) * sizeof(Compressor);
+  for (const std::string& fn : inputNames) {
+    struct stat st;
+    if (!stat(fn.c_str(), &st)) size += 8 * (u64)st.st_size;
+  }
+  return size;
+}
+
+// Runs the links of a manifest with one job per line, each line holding the
+// arguments of a link as on the command line. Empty lines and lines starting
+// with # are skipped, and the arguments given with -b apply to all jobs. As
+// many jobs run at once as there are cores and fit in the memory limit.
+bool LinkBatch(const Args& common, const char* manifest, u64 memoryLimit) {
+  FILE* f = fopen(manifest, "r");
+  if (!f) {
+    printf("Could not open %s\n", manifest);
+    return false;
+  }
+  struct Job {
+    Args args;
+    std::vector<std::string> inputs;
+    std::string name;
+    u64 memory;
+    bool ok;
+  };
+  std::vector<Job> jobs;
+  char line[4096];
+  while (fgets(line, sizeof(line), f)) {
+    std::vector<std::string> argv;
+    for (char* t = strtok(line, " \t\r\n"); t; t = strtok(nullptr, " \t\r\n")) {
+      argv.push_back(t);
+    }
+    if (argv.empty() || argv[0][0] == '#') continue;
+    Job job;
+    job.args = common;
+    job.args.erase('b');
+    ParseArgs(argv, &job.args, &job.inputs);
+    args = &job.args;
+    job.memory = LinkMemory(job.inputs);
+    args = &common;
+    job.ok = false;
+    jobs.push_back(job);
+  }
+  fclose(f);
+  for (u32 i = 0; i < jobs.size(); ++i) {
+    char name[32];
+    snprintf(name, sizeof(name), "%u/%u ", i + 1, (u32)jobs.size());
+    Args::const_iterator out = jobs[i].args.find('o');
+    jobs[i].name = name + (out != jobs[i].args.end() ? *out->second.begin() : std::string("c.out"));
+  }
+
+  // A job waits for memory to become free, unless nothing else is running.
+  std::mutex lock;
+  std::condition_variable finished;
+  u64 memoryUsed = 0;
+  u32 running = 0;
+  u32 maxRunning = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<std::thread> threads;
+  auto start = std::chrono::steady_clock::now();
+  for (Job& job : jobs) {
+    {
+      std::unique_lock<std::mutex> l(lock);
+      finished.wait(l, [&]() {
+        return running == 0 || (running < maxRunning && memoryUsed + job.memory <= memoryLimit);
+      });
+      memoryUsed += job.memory;
+      ++running;
+    }
+    printf("[%s] Started\n", job.name.c_str());
+    Job* j = &job;
+    threads.push_back(std::thread([&, j]() {
+      args = &j->args;
+      jobName = j->name.c_str();
+      j->ok = LinkFiles(j->inputs);
+      printf("[%s] %s\n", jobName, j->ok ? "Done" : "Failed");
+      std::lock_guard<std::mutex> l(lock);
+      memoryUsed -= j->memory;
+      --running;
+      finished.notify_all();
+    }));
+  }
+  for (std::thread& t : threads) {
+    t.join();
+  }
+  u32 failed = 0;
+  for (const Job& job : jobs) {
+    if (!job.ok) ++failed;
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  printf("Linked %u jobs in %.1f s, %u failed\n", (u32)jobs.size(), seconds, failed);
+  return failed == 0;
+}
+
+int main(int argc, char* argv[]) {
+  Args common;
+  std::vector<std::string> inputNames;  // In command line order.
+  ParseArgs(std::vector<std::string>(argv + 1, argv + argc), &common, &inputNames);
+  args = &common;
+
+  // The pool keeps a Compressor per worker, so -fmemory=MB, by default half
+  // of the physical memory, limits the workers as well as the batch jobs.
+  u64 memoryLimit = (u64)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE) / 2;
+  if (FlagValue("memory", nullptr)) memoryLimit = (u64)atoi(FlagValue("memory", "0")) << 20;
+  // The workers get at most half of it.
+  u32 threads = std::max(1u, std::thread::hardware_concurrency());
+  threads = std::max<u64>(1, std::min<u64>(threads, memoryLimit / sizeof(Compressor) / 2));
+  pool.Start(threads);
+  memoryLimit -= std::min<u64>(memoryLimit, threads * sizeof(Compressor));
+
+  bool ok;
+  if (FlagValue("serve", nullptr)) {
+    // Links with -fdaemon=<socket> have this process search their parameters.
+    DaemonServe(FlagValue("serve", nullptr), ParallelTrials, nullptr);
+    ok = false;
+  } else if (Arg('b').size()) {
+    ok = LinkBatch(common, Arg('b').begin()->c_str(), memoryLimit);
   } else {
-    printf("Cannot handle architecture in %s (arch = %2.2x)\n", fn, arch);
-    return 1;
+    ok = LinkFiles(inputNames);
   }
+  return ok ? 0 : 1;
 }
@@ -16,7 +16,9 @@
 
 bits 32
 base equ 0x08000000
-ccount equ 8 ; Number of contexts.
+maxcount equ 16 ; Most contexts elfling can use.
+ccount equ 8 ; Number of contexts, elfling patches in the number it chose.
+slotsize equ 4 + 2 * 255 ; Context plus 255 counter pairs, BYTEMODEL only.
 
 ; Elf32_Ehdr
 db 0x7f, 'ELF'  ; e_ident (the part that is validated)
@@ -94,29 +96,41 @@ db 'libSDL-1.2.so.0', 0  ; Gets us libc, but no OpenGL.
 
 v_dataend equ 0 ; Last dword of compressed data
 v_osize equ 4 ; This is written in by elfling
-v_weights equ 8 ; This is written in by elfling
-v_contexts equ v_weights + ccount ; This is written in by elfling
-v_archive equ v_contexts + ccount ; This is the start of our runtime variables
+v_weights equ 8 ; Weight and context mask of each context, written in by elfling
+v_contexts equ v_weights + 1
+v_archive equ v_weights + 2 * maxcount ; This is the start of our runtime variables
 v_x2 equ v_archive + 4
 v_x1 equ v_x2 + 4
-v_cp equ v_x1 + 4
-v_counters equ v_cp + 4 * ccount
+v_cp equ v_x1 + 4 ; Current counters, or slot + 2 with BYTEMODEL.
+v_counters equ v_cp + 4 * maxcount
+v_w equ v_counters + 4 * maxcount ; Weight of each context in 1/65536, MIXMODEL only.
+v_st equ v_w + 4 * maxcount ; Stretched probability of each context, MIXMODEL only.
+v_p equ v_st + 4 * maxcount ; Mixed probability of a 1, then its error, MIXMODEL only.
+v_mixtab equ v_p + 4 ; Squash table at +0x2000 and stretch table at +0x4000, MIXMODEL only.
+v_segment equ v_counters + 4 * maxcount ; Next entry of the segment table, SEGMENTS only.
 
 entry:
-; The destination is placed at 64k, so the compressed data cannot be larger than that. We also need
-; some space for the variables. 
+; The destination is placed at 64k, or higher if the compressed data and the variables after it
+; do not fit below that. elfling works out the layout and patches the three immediates below.
 mov ebp, 0xffffffff ; Keep variables just after compressed data, replaced by elfling
-mov edi, base + 0x10000  ; Dest [keep in edi]
+mov edi, base + 0x10000  ; Dest [keep in edi], replaced by elfling
 push edi ; Push dest address for jumping to when we have finished decompression.
 inc byte [edi] ; Set first output byte to 1.
 mov dword [ebp + v_archive], ebp ; Current input pointer.
 
 xor ecx, ecx
-mov cl, ccount
-mov dl, 9
+..@ccount1: mov cl, ccount
+mov dl, 9 ; Top byte of the first counter table, replaced by elfling
 .nextCounter:
 mov byte [ebp + v_counters + ecx * 4 - 4 + 3], dl ; Address is 0x09000000 (and then 0x0a, 0x0b, 0x0c, ...)
+%ifndef BYTEMODEL
 mov byte [ebp + v_cp + ecx * 4 - 4 + 3], dl
+%endif
+%ifdef MIXMODEL
+movzx eax, byte [ebp + v_weights + ecx * 2 - 2]
+shl eax, 10
+mov [ebp + v_w + ecx * 4 - 4], eax ; Initial weight, in 1/64
+%endif
 inc dl
 loop .nextCounter
 
@@ -124,21 +138,148 @@ mov [ebp + v_x1], ecx ; x1 = 0
 dec ecx
 mov [ebp + v_x2], ecx ; x2 = 0xffffffff
 inc ecx
+%ifdef SEGMENTS
+mov dword [ebp + v_segment], base + segments
+%endif
+
+%ifdef MIXMODEL
+; Build the tables of the mixer in the 16 MB after the counter tables, the same way pack.cpp does:
+; squash(x) starts at 1/2 and grows by p (1 - p) / 256 per step, stretch is its inverse.
+movzx ebx, dl
+shl ebx, 24
+mov [ebp + v_mixtab], ebx
+push edi
+add ebx, 0x2000 ; squash(x) [ebx]
+mov edi, ebx ; squash(-x) [edi]
+mov esi, 0x80000000 ; p in 1/2^32 [esi]
+mov ch, 8 ; Next stretch entry, 2048 [ecx]
+.nextsquash:
+mov eax, esi
+shr eax, 20
+mov [ebx], ax
+neg eax
+add eax, 4096
+mov [edi], ax
+.nextstretch:
+mov eax, esi
+shr eax, 20
+cmp ecx, eax
+ja .stretchdone
+mov eax, ebx
+sub eax, edi
+shr eax, 2 ; x
+mov edx, [ebp + v_mixtab]
+mov [edx + 2 * ecx + 0x4000], ax ; stretch(next) = x
+add edx, 0x4000 + 2 * 4095
+sub edx, ecx
+sub edx, ecx
+neg eax
+mov [edx], ax ; stretch(4095 - next) = -x
+inc ecx
+jmp .nextstretch
+.stretchdone:
+mov eax, esi
+neg eax
+mul esi
+shr edx, 8
+add esi, edx ; p += p * (1 - p) >> 40
+inc ebx
+inc ebx
+dec edi
+dec edi
+cmp ch, 16
+jb .nextsquash
+pop edi
+xor ecx, ecx
+%endif
 
 .iterate:
+%ifdef BYTEMODEL
+cmp byte [edi], 1 ; Look up the slots of all contexts when a new byte starts.
+jne .sameslots
+..@ccount2: mov cl, ccount
+.nextslot:
+xor eax, eax
+mov bl, 1 ; Mask bit
+mov bh, [ebp + v_contexts + ecx * 2 - 2]
+.nextcontextbyte:
+test bh, bl
+jz .notused
+shl eax, 8
+mov al, byte [edi]
+.notused:
+dec edi
+shl bl, 1
+jnz .nextcontextbyte
+add edi, 8
+mov esi, [ebp + v_counters + ecx * 4 - 4]
+.nextval:
+cmp dword [esi], eax
+je .foundentry
+cmp dword [esi], 0
+je .foundentry
+add esi, slotsize
+jmp .nextval
+.foundentry:
+mov dword [esi], eax
+inc esi
+inc esi ; Adding twice the partial byte selects its counter pair.
+mov [ebp + v_cp + ecx * 4 - 4], esi
+loop .nextslot
+.sameslots:
+%endif
+%ifdef MIXMODEL
+xor ebx, ebx ; Sum of w * st >> 16 [ebx]
+..@ccount3: mov cl, ccount
+.nextinput:
+mov esi, [ebp + v_cp + ecx * 4 - 4]
+movzx eax, word [esi]
+xor ah, 0x80 ; Probabilities are kept xor 0x8000, so that empty slots start at 1/2.
+shr eax, 4
+mov esi, [ebp + v_mixtab]
+movsx eax, word [esi + 2 * eax + 0x4000]
+mov [ebp + v_st + ecx * 4 - 4], eax
+imul dword [ebp + v_w + ecx * 4 - 4]
+shrd eax, edx, 16
+add ebx, eax
+loop .nextinput
+add ebx, 2047
+jns .notbelow
+xor ebx, ebx
+.notbelow:
+cmp ebx, 4094
+jle .notabove
+mov ebx, 4094
+.notabove:
+movzx eax, word [esi + 2 * ebx + 0x2000 - 2 * 2047] ; p1 = squash(sum)
+mov [ebp + v_p], eax
+
+; u32 xmid = x1 + (x2 - x1) * (u64)(4096 - p1) >> 12;
+neg eax
+add eax, 4096
+mov edx, [ebp + v_x2]
+sub edx, [ebp + v_x1] ; (x2 - x1) [edx]
+mul edx
+shrd eax, edx, 12
+add eax, [ebp + v_x1] ; xmid [eax]
+%else
 xor eax, eax
 xor edx, edx
 inc edx ; n0 = 1 [edx]
 lea ebx, [2 * edx] ;  n0 + n1 = 2 [ebx]
-mov cl, ccount
+..@ccount3: mov cl, ccount
 .nextweight:
 mov esi, [ebp + v_cp + ecx * 4 - 4]
+%ifdef BYTEMODEL
+movzx eax, byte [edi] ; Partial byte
+lea esi, [esi + 2 * eax]
+%endif
 lodsb
-mul byte [ebp + v_weights + ecx - 1]
+mul byte [ebp + v_weights + ecx * 2 - 2]
 add edx, eax ; n0
 add ebx, eax ; n0 + n1
 lodsb
-mul byte [ebp + v_weights + ecx - 1]
+mul byte [ebp + v_weights + ecx * 2 - 2]
 add ebx, eax ; n0 + n1
 loop .nextweight
 
@@ -149,6 +290,7 @@ sub edx, [ebp + v_x1] ; (x2 - x1) [edx]
 mul edx
 div ebx
 add eax, [ebp + v_x1] ; xmid [eax]
+%endif
 
 xor edx, edx
 mov esi, [ebp + v_archive] ; archive
@@ -162,15 +304,82 @@ mov [ebp + v_x1], eax
 inc edx
 .iszero:
 
+%ifdef BYTEMODEL
+..@ccount4: mov cl, ccount
+.nextcount:
+mov esi, [ebp + v_cp + ecx * 4 - 4]
+movzx eax, byte [edi] ; Partial byte
+lea esi, [esi + 2 * eax]
+add esi, edx ; Select counter matching our bit
+add byte[esi], 1 ; Increment counter by one
+sbb byte[esi], 0 ; If we overflow, return it to 255
+xor esi, 1 ; Select the other counter.
+cmp byte [esi], 2
+jb .noadjust
+shr byte [esi], 1
+inc byte [esi]
+.noadjust:
+loop .nextcount
+shr edx, 1 ; Put our bit back into carry.
+%endif
+
 rcl byte[edi], 1 ; Shift top bit of edi into carry, shift in carry (which contains the bit we want to add).
 jnc .notyet ; If we shifted out a one, the byte is complete, move on to next byte.
 inc edi
 inc byte [edi]
+%ifdef SEGMENTS
+; Each entry of the segment table holds the address of the first byte of a segment, followed by
+; the weights and context masks for it. The table ends with an address of 0.
+mov esi, [ebp + v_segment]
+cmp edi, [esi]
+jne .notyet
+lodsd
+push edi
+lea edi, [ebp + v_weights]
+..@ccount6: mov cl, ccount
+rep movsw
+pop edi
+mov [ebp + v_segment], esi
+%endif
 .notyet:
 
-mov cl, ccount
+%ifndef BYTEMODEL
+%ifdef MIXMODEL
+mov eax, edx
+shl eax, 12
+sub eax, [ebp + v_p]
+mov [ebp + v_p], eax ; err = (y << 12) - p1
+%endif
+..@ccount5: mov cl, ccount
 .nextmodel:
 mov esi, [ebp + v_cp + ecx * 4 - 4]
+%ifdef MIXMODEL
+mov eax, [ebp + v_st + ecx * 4 - 4]
+imul eax, [ebp + v_p]
+sar eax, 10
+add [ebp + v_w + ecx * 4 - 4], eax ; w += st * err >> 10
+movzx eax, word [esi]
+xor ah, 0x80
+push ecx
+mov ecx, eax
+and ecx, 15
+inc ecx ; n + 1
+shr eax, 4
+mov ebx, edx
+shl ebx, 12
+sub ebx, eax
+sar ebx, cl
+add eax, ebx ; p += ((y << 12) - p) >> (n + 1)
+shl eax, 4
+cmp cl, 3
+jbe .counted
+mov cl, 3
+.counted:
+or eax, ecx ; n = min(n + 1, 3)
+pop ecx
+xor ah, 0x80
+mov [esi], ax
+%else
 add esi, edx ; Select counter matching our bit
 add byte[esi], 1 ; Increment counter by one
 sbb byte[esi], 0 ; If we overflow, return it to 255
@@ -180,9 +389,20 @@ jb .noadjust
 shr byte [esi], 1
 inc byte [esi]
 .noadjust:
+%endif
 xor eax, eax
 mov bl, 1 ; Mask bit
-mov bh, [ebp + v_contexts + ecx - 1]
+mov bh, [ebp + v_contexts + ecx * 2 - 2]
+%ifdef STRIDES
+test bh, bl
+jnz .nextcontextbyte
+movzx esi, bh ; A mask with bit 0 clear takes the partial byte and the byte mask / 2 back.
+shr esi, 1
+neg esi
+mov ah, [edi]
+mov al, [edi + esi]
+jmp .havecontext
+%endif
 .nextcontextbyte:
 test bh, bl
 jz .notused
@@ -193,6 +413,7 @@ dec edi
 shl bl, 1
 jnz .nextcontextbyte
 add edi, 8
+.havecontext:
 mov esi, [ebp + v_counters + ecx * 4 - 4]
 .nextval:
 cmp dword [esi], eax
@@ -205,7 +426,13 @@ jmp .nextval
 mov dword [esi], eax
 add esi, 4
 mov [ebp + v_cp + ecx * 4 - 4], esi
+%ifdef MIXMODEL
+dec ecx
+jnz .nextmodel ; Too far for loop.
+%else
 loop .nextmodel
+%endif
+%endif
 
 .killbits:
 mov edx, [ebp + v_x1]
@@ -222,12 +449,13 @@ dec dword [ebp + v_osize]  ; Size
 jnz .iterate
 ret
 
+segments: ; With SEGMENTS, elfling places the segment table here, before the compressed data.
 db'XXXX-Compressed code here-XXXX'
 
 ; The code that comes after here is actually compressed. It contains the dynamic linker.
 
 compentry:
-mov ebp, base + 0x10000 + .hashes - compentry + 1
+mov ebp, base + 0x10000 + .hashes - compentry + 1 ; elfling adds how far dest moved up from 64k
 .nexthash:
 mov ebx, base + debug  ; DT_DEBUG value offset
 mov ebx, [ebx] ; Load debug table offset
@@ -285,3 +513,103 @@ jmp 0x12345678 ; Jump to real entry point.
 .hashes:
 ; The hash table is placed here.
 
+db 'XXXX-Branch filter here-XXXX'
+
+; With -fbranch, elfling places this at the end of the image and jumps here instead of
+; to the entry point. elfling turned the rel32 of call, jmp and jcc into absolute addresses to help
+; compression, this turns them back. It checks the same bytes in the same order as elfling, so the
+; displacements it changes are exactly the ones elfling changed.
+unfilter:
+mov edi, base + 0x10000 ; Start of code, replaced by elfling
+mov esi, base + 0x10000 ; End of code less 4, replaced by elfling
+xor eax, eax
+.nextop:
+mov ah, al ; Previous opcode byte
+mov al, [edi]
+inc edi
+mov dl, al
+and dl, 0xfe
+cmp dl, 0xe8 ; call or jmp rel32
+je .branch
+cmp ah, 0x0f
+jne .nobranch
+mov dl, al
+and dl, 0xf0
+cmp dl, 0x80 ; 0x0f 0x8x is jcc rel32
+jne .nobranch
+.branch:
+add edi, 4
+sub [edi - 4], edi ; Absolute target to relative to the next instruction.
+.nobranch:
+cmp edi, esi
+jb .nextop
+jmp 0x12345678 ; Jump to real entry point, replaced by elfling
+
+db 'XXXX-Data filter here-XXXX'
+
+; With data filters, elfling places this, followed by a table of the sections it filtered, before the
+; inverse of the branch filter. Each table entry holds the address of a section and its number of
+; 4-byte elements, with the filter in the top byte: bit 0 for delta coding of the elements, bit 1
+; for storing their bytes as 4 planes. An address of 0 ends the table. ebp points at scratch memory
+; for the planes, the first counter table, which is no longer needed.
+unfilterdata:
+mov ebx, 0xffffffff ; Address of the table, replaced by elfling
+mov ebp, 0x09000000 ; Scratch memory, replaced by elfling
+.nextsection:
+mov edi, [ebx] ; Address of the section
+test edi, edi
+jz .done
+mov ecx, [ebx + 4]
+mov edx, ecx
+shr edx, 24 ; Filter
+and ecx, 0xffffff ; Number of elements
+add ebx, 8
+test dl, 2
+jz .notransposed
+push edi ; Copy the planes to scratch memory, then interleave them again.
+push ecx
+mov esi, edi
+mov edi, ebp
+shl ecx, 2
+rep movsb
+pop ecx
+pop edi
+mov esi, ebp
+mov dh, 4 ; Planes
+.nextplane:
+push edi
+push ecx
+.nextbyte:
+movsb
+add edi, 3
+loop .nextbyte
+pop ecx
+pop edi
+inc edi
+dec dh
+jnz .nextplane
+sub edi, 4
+.notransposed:
+test dl, 1
+jz .nextsection
+xor eax, eax
+.nextelement:
+add eax, [edi] ; Each element was stored as the difference to the one before.
+stosd
+loop .nextelement
+jmp .nextsection
+.done:
+jmp 0xffffffff ; Jump to the inverse of the branch filter or the real entry point, replaced by elfling
+
+db 'XXXX-Context count here-XXXX'
+
+; Where the code above has the number of contexts, for elfling to patch in the number it chose.
+dw ..@ccount1 + 1, ..@ccount3 + 1
+%ifdef BYTEMODEL
+dw ..@ccount2 + 1, ..@ccount4 + 1
+%else
+dw ..@ccount5 + 1
+%ifdef SEGMENTS
+dw ..@ccount6 + 1
+%endif
+%endif
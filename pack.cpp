@@ -16,20 +16,69 @@
 
 #include "pack.h"
 
+#include <algorithm>
+
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
-int cmax = 0;
+double reciprocalTable[256];
+
+static bool InitReciprocalTable() {
+  for (int i = 0; i < 256; ++i) {
+    reciprocalTable[i] = 512.0 / (512 + 2 * i + 1);  // Bucket midpoint.
+  }
+  return true;
+}
+
+static bool reciprocalTableReady = InitReciprocalTable();
+
+MixTables mixTables;
+
+static bool InitMixTables() {
+  u32 p = 0x80000000;  // squash(x) << 20
+  int next = 2048;  // Next entry of stretch.
+  for (int x = 0; next < 4096; ++x) {
+    int q = p >> 20;
+    if (x < 2048) {
+      mixTables.squash[2047 + x] = q;
+      mixTables.squash[2047 - x] = 4096 - q;
+    }
+    for (; next <= q; ++next) {
+      mixTables.stretch[next] = x;
+      mixTables.stretch[4095 - next] = -x;
+    }
+    p += (u32)((u64)p * (u32)-p >> 40);
+  }
+  return true;
+}
+
+static bool mixTablesReady = InitMixTables();
 
+// The search starts from CONTEXT_COUNT contexts and adds or drops them
+// while it runs, within MIN_CONTEXT_COUNT and MAX_CONTEXT_COUNT.
 #define CONTEXT_COUNT 8
+#define MIN_CONTEXT_COUNT 2
 
 #define GENOME_SIZE 48
 #define GENOME_ITERATIONS 100
 
+// A search that has not improved for STALL_GENERATIONS, or whose population
+// has collapsed into few distinct genomes, restarts all but the RESTART_KEEP
+// best genomes, and stops when that happens once more after MAX_RESTARTS.
+#define STALL_GENERATIONS 12
+#define MAX_RESTARTS 2
+#define RESTART_KEEP 4
+#define MAX_MUTATIONS 6
+
 #define MAX_WEIGHT 60
 
+// Initial weight of every MODEL_MIX context, in 1/64. The mixer learns the
+// weights, so the search leaves them alone.
+#define MIX_WEIGHT 24
+
 int FromHexDigit(char d) {
   if (d >= '0' && d <= '9') return d - '0';
   if (d >= 'A' && d <= 'F') return d - 'A' + 10;
@@ -72,26 +121,176 @@ void CompressionParameters::ToString(char* str) {
   str[2 + 4 * contextCount] = 0;
 }
 
+void ContextPrior::Add(const CompressionParameters& params) {
+  contextCount = (contextCount * inputs + params.contextCount + inputs / 2) / (inputs + 1);
+  ++inputs;
+  for (int i = 0; i < params.contextCount; ++i) {
+    u8 mask = params.contexts[i];
+    bool seen = !mask;
+    for (int k = 0; k < i; ++k) {
+      if (params.contexts[k] == mask) seen = true;
+    }
+    if (seen) continue;
+    int j = 0;
+    while (j < count && masks[j] != mask) ++j;
+    if (j == count) {
+      masks[j] = mask;
+      hits[j] = 0;
+      weights[j] = 0;
+      ++count;
+    }
+    if (hits[j] == 65535) continue;
+    weights[j] = (weights[j] * hits[j] + params.weights[i] + hits[j] / 2) / (hits[j] + 1);
+    ++hits[j];
+    // Keep the most used masks first.
+    for (; j > 0 && hits[j] > hits[j - 1]; --j) {
+      u8 m = masks[j], w = weights[j];
+      u16 h = hits[j];
+      masks[j] = masks[j - 1];
+      weights[j] = weights[j - 1];
+      hits[j] = hits[j - 1];
+      masks[j - 1] = m;
+      weights[j - 1] = w;
+      hits[j - 1] = h;
+    }
+  }
+}
+
+bool ContextPrior::Load(const char* path) {
+  FILE* fptr = fopen(path, "r");
+  if (!fptr) return false;
+  bool rv = fscanf(fptr, "elfling-prior %d %d %d", &format, &inputs, &contextCount) == 3;
+  unsigned mask, hit, weight;
+  count = 0;
+  while (rv && count < 255 && fscanf(fptr, "%x %u %u", &mask, &hit, &weight) == 3) {
+    if (!mask || mask > 255 || !hit || hit > 65535 || weight > 255) {
+      rv = false;
+      break;
+    }
+    masks[count] = mask;
+    hits[count] = hit;
+    weights[count] = weight;
+    ++count;
+  }
+  fclose(fptr);
+  return rv && count > 0;
+}
+
+bool ContextPrior::Save(const char* path) const {
+  FILE* fptr = fopen(path, "w");
+  if (!fptr) return false;
+  fprintf(fptr, "elfling-prior %d %d %d\n", format, inputs, contextCount);
+  for (int i = 0; i < count; ++i) {
+    fprintf(fptr, "%2.2x %d %d\n", masks[i], hits[i], weights[i]);
+  }
+  return fclose(fptr) == 0;
+}
+
 struct Context {
   u8 ctx;
   int bs;
   int bw;
 };
 
-static int CompareContext(const Context* a, const Context* b) {
-  return a->bs - b->bs;
+// What Compressor::Screen learns about single context masks: their cost
+// next to mask 1, best first, and how the best SCREEN_PAIRS of them interact.
+#define SCREEN_PAIRS 16
+struct Screening {
+  int count = 0;
+  u8 masks[255];
+  double cost[255];  // Bits of the data with the mask at weight 8 and mask 1 at weight 1.
+  double baseCost = 0;  // Bits with mask 1 alone.
+  int pairCount = 0;
+  // Bits a pair of the first pairCount masks saves beyond what each saves alone.
+  double interaction[SCREEN_PAIRS][SCREEN_PAIRS];
+};
+
+// Returns the bits needed to code in from counter histories, two bytes per
+// bit as CounterHistory records them, each weighted as it would be in
+// CompressSingle. Leaves out the rounding of the coder.
+static double HistoryCost(const u8* in, int inLen, const u8* const* history, const u32* weights, int count) {
+  double p = 1;
+  int exponent = 0;
+  for (int b = 0; b < 8 * inLen; ++b) {
+    u32 n0 = 1, n1 = 1;
+    for (int k = 0; k < count; ++k) {
+      n0 += history[k][2 * b] * weights[k];
+      n1 += history[k][2 * b + 1] * weights[k];
+    }
+    int y = (in[b >> 3] >> (7 - (b & 7))) & 1;
+    p *= (double)(y ? n1 : n0) / (n0 + n1);
+    if (p < 1e-100) {
+      int e;
+      p = frexp(p, &e);
+      exponent += e;
+    }
+  }
+  return -(log2(p) + exponent);
+}
+
+// Returns the bits needed to code in with one context changed, from the
+// counter totals of all contexts as they are, n0 and n1 per bit: history out
+// at weight wOut gives way to history with at weight wIn. Either may be the
+// same history, to change a weight only.
+static double SwapCost(const u8* in, int inLen, const u32* totals, const u8* out, u32 wOut, const u8* with,
+                       u32 wIn) {
+  double p = 1, q = 1;  // Probability p / q * 2^exponent, without a divide per bit.
+  int exponent = 0;
+  for (int b = 0; b < 8 * inLen; ++b) {
+    u32 n0 = totals[2 * b] - out[2 * b] * wOut + with[2 * b] * wIn;
+    u32 n1 = totals[2 * b + 1] - out[2 * b + 1] * wOut + with[2 * b + 1] * wIn;
+    int y = (in[b >> 3] >> (7 - (b & 7))) & 1;
+    p *= y ? n1 : n0;
+    q *= n0 + n1;
+    if (q > 1e100) {  // Both shrink or grow together, q the faster.
+      int e, f;
+      p = frexp(p, &e);
+      q = frexp(q, &f);
+      exponent += e - f;
+    }
+  }
+  return -(log2(p / q) + exponent);
 }
 
 struct Genome {
   CompressionParameters params;
   int fitness;
+  int size;
+  u64 steps;
 };
 
+#define FRONT_SIZE 16
+
+// Keeps the genomes for which no other genome seen so far is both smaller
+// and faster to decompress.
+static void AddToFront(Genome* front, int* frontCount, const Genome& g) {
+  for (int i = 0; i < *frontCount; ++i) {
+    if (front[i].size <= g.size && front[i].steps <= g.steps) return;
+  }
+  int n = 0;
+  for (int i = 0; i < *frontCount; ++i) {
+    if (g.size > front[i].size || g.steps > front[i].steps) {
+      front[n++] = front[i];
+    }
+  }
+  if (n < FRONT_SIZE) {
+    front[n++] = g;
+  }
+  *frontCount = n;
+}
+
+static int CompareFront(const Genome* a, const Genome* b) {
+  return a->size - b->size;
+}
+
 static int CompareGenome(const Genome* a, const Genome* b) {
   if (a->fitness != b->fitness) {
     return a->fitness - b->fitness;
   }
-  for (int i = 0; i < CONTEXT_COUNT; ++i) {
+  if (a->params.contextCount != b->params.contextCount) {
+    return a->params.contextCount - b->params.contextCount;
+  }
+  for (int i = 0; i < a->params.contextCount; ++i) {
     if (a->params.weights[i] != b->params.weights[i])
       return a->params.weights[i] - b->params.weights[i];
     if (a->params.contexts[i] != b->params.contexts[i])
@@ -100,87 +299,814 @@ static int CompareGenome(const Genome* a, const Genome* b) {
   return 0;
 }
 
+static bool SameParams(const CompressionParameters& a, const CompressionParameters& b) {
+  return a.contextCount == b.contextCount && !memcmp(a.weights, b.weights, a.contextCount) &&
+         !memcmp(a.contexts, b.contexts, a.contextCount);
+}
+
+static int DistinctGenomes(const Genome* g, int count) {
+  int distinct = 0;
+  for (int i = 0; i < count; ++i) {
+    int j = 0;
+    while (j < i && !SameParams(g[i].params, g[j].params)) ++j;
+    if (j == i) ++distinct;
+  }
+  return distinct;
+}
+
+// Returns the next number of a xorshift generator, so that searches on
+// several threads do not share the state of rand().
+static u32 Random(u32* state) {
+  u32 x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *state = x;
+  return x >> 1;
+}
+
+static u8 RandomWeight(const CompressionParameters* params, u32* random) {
+  return params->format == MODEL_MIX ? MIX_WEIGHT : Random(random) % MAX_WEIGHT + 1;
+}
+
+// Sets context j to a mask drawn from the prior by how often it won, with
+// its usual weight give or take a little. total is the sum of the hits.
+static void DrawFromPrior(const ContextPrior* prior, u32 total, CompressionParameters* params, int j, u32* random) {
+  u32 r = Random(random) % total;
+  int k = 0;
+  while (r >= prior->hits[k]) {
+    r -= prior->hits[k++];
+  }
+  int w = prior->weights[k] + (int)(Random(random) % 9) - 4;
+  params->contexts[j] = prior->masks[k];
+  params->weights[j] = params->format == MODEL_MIX ? MIX_WEIGHT : w < 1 ? 1 : w > MAX_WEIGHT ? MAX_WEIGHT : w;
+}
+
+// Fills out a genome of the first population or of a restart. The best one
+// takes the best masks of the pre-scan, the others random ones.
+static void SeedGenome(CompressionParameters* params, int format, bool best, int contextCount, const Context* pats,
+                       u32 pc, const ContextPrior* prior, u32 priorTotal, u32* random) {
+  bool mix = format == MODEL_MIX;
+  params->format = format;
+  params->contextCount = best ? CONTEXT_COUNT : contextCount - 3 + Random(random) % 7;
+  params->contexts[0] = 1;
+  params->weights[0] = mix ? MIX_WEIGHT : 1;
+  for (int j = 1; j < params->contextCount; ++j) {
+    if (best) {
+      params->contexts[j] = pats[j - 1].ctx;
+      params->weights[j] = mix ? MIX_WEIGHT : 20;
+    } else if (prior && Random(random) % 4) {
+      DrawFromPrior(prior, priorTotal, params, j, random);
+    } else {
+      params->contexts[j] = pats[Random(random) % (pc / 4)].ctx;
+      params->weights[j] = RandomWeight(params, random);
+    }
+  }
+}
+
+// Returns the screened mask that adds the most to the masks of params,
+// judged by its interactions with them, or -1 if none of them was screened.
+static int BestPartner(const CompressionParameters* params, const Screening* screen) {
+  int best = -1;
+  double bestGain = 0;
+  for (int k = 0; k < screen->pairCount; ++k) {
+    bool present = false, screened = false;
+    double gain = screen->baseCost - screen->cost[k];
+    for (int m = 0; m < params->contextCount; ++m) {
+      present = present || params->contexts[m] == screen->masks[k];
+      for (int i = 0; i < screen->pairCount; ++i) {
+        if (params->contexts[m] == screen->masks[i]) {
+          gain += screen->interaction[k][i];
+          screened = true;
+        }
+      }
+    }
+    if (!present && screened && (best < 0 || gain > bestGain)) {
+      best = k;
+      bestGain = gain;
+    }
+  }
+  return best;
+}
+
+// Makes the masks of the best first genome mask 1 and then, one at a time,
+// the screened mask whose saving plus its interactions with those picked so
+// far is largest.
+static void PickInteracting(CompressionParameters* params, const Screening* screen) {
+  if (!screen->pairCount) return;
+  params->contextCount = 1;
+  while (params->contextCount < CONTEXT_COUNT) {
+    int k = BestPartner(params, screen);
+    if (k < 0 && params->contextCount == 1) k = 0;  // Mask 1 alone has no interactions yet.
+    if (k < 0) break;
+    params->contexts[params->contextCount++] = screen->masks[k];
+  }
+}
+
+// Changes one weight or context, or now and then adds or drops a context, or
+// replaces one with the mask that screening found to go best with the rest.
+static void Mutate(CompressionParameters* params, const Context* pats, int pc, const Screening* screen, u32* random) {
+  int n = params->contextCount;
+  int r = Random(random) % 16;
+  int partner = r == 2 && n > 1 ? BestPartner(params, screen) : -1;
+  if (partner >= 0) {
+    params->contexts[1 + Random(random) % (n - 1)] = screen->masks[partner];
+  } else if (r == 0 && n < MAX_CONTEXT_COUNT) {
+    params->contexts[n] = pats[Random(random) % pc].ctx;
+    params->weights[n] = RandomWeight(params, random);
+    params->contextCount = n + 1;
+  } else if (r == 1 && n > MIN_CONTEXT_COUNT) {
+    int drop = Random(random) % n;
+    memmove(&params->contexts[drop], &params->contexts[drop + 1], n - drop - 1);
+    memmove(&params->weights[drop], &params->weights[drop + 1], n - drop - 1);
+    params->contextCount = n - 1;
+  } else {
+    int byte = Random(random) % (params->format == MODEL_MIX ? n : 2 * n);
+    if (byte < n) {
+      params->contexts[byte] = pats[Random(random) % pc].ctx;
+    } else {
+      params->weights[byte - n] = RandomWeight(params, random);
+    }
+  }
+}
+
+Compressor::~Compressor() {
+  free(scratch_);
+}
+
+int Compressor::TrialSize(CompressionParameters* params, const void* in, int inLen) {
+  // Trial compressions count as failed if they expand the data by more than 2x.
+  int size = 2 * inLen + 1024;
+  if (size > scratchSize_) {
+    free(scratch_);
+    scratch_ = (u8*)malloc(size);
+    scratchSize_ = size;
+  }
+  CompressSingle(params, (void*)in, inLen, scratch_, &size);
+  return size;
+}
+
+// A set of trial compressions for Compressor::Trials.
+struct Trials {
+  CompressionParameters** params;
+  int** sizes;
+  const void* in;
+  int inLen;
+};
+
+static void RunTrial(void* arg, int i, Compressor* c) {
+  Trials* t = (Trials*)arg;
+  *t->sizes[i] = c->TrialSize(t->params[i], t->in, t->inLen);
+}
+
+void Compressor::Trials(CompressionParameters** params, int** sizes, int count, const void* in, int inLen) {
+  struct Trials t = { params, sizes, in, inLen };
+  if (parallel_) {
+    parallel_(parallelCtx_, count, RunTrial, &t);
+  } else {
+    for (int i = 0; i < count; ++i) {
+      RunTrial(&t, i, this);
+    }
+  }
+}
+
+// Fills masks with those the header stubs can use besides mask 1, and returns
+// how many there are. Keys are 32 bits, so masks can select 4 bytes at most,
+// the partial byte included. Stride contexts start where the other masks end,
+// 8 bytes back.
+static int UsableMasks(bool strides, u8* masks) {
+  int count = 0;
+  for (u32 i = 3; i < 256; ++i) {
+    if (IsStride(i)) {
+      if (!strides || i >> 1 < 8 || i >> 1 > MAX_STRIDE) continue;
+    } else {
+      u32 bc = 0;
+      for (u8 b = 0; b < 8; ++b) {
+        if (i & (1 << b)) ++bc;
+      }
+      if (bc > 4) continue;
+    }
+    masks[count++] = i;
+  }
+  return count;
+}
+
+// Ranks every mask the header stubs can use, from the counter history of
+// each: the counters of a context do not depend on the other contexts, so
+// one pass per mask is enough, and the cost of the mask next to mask 1, or of
+// a pair of masks, follows from the histories without compressing again.
+void Compressor::Screen(int format, const u8* in, int inLen, Screening* screen) {
+  screen->count = UsableMasks(strides_, screen->masks);
+
+  struct Work {
+    Screening* screen;
+    int format;
+    const u8* in;
+    int inLen;
+    u8* base;  // History of mask 1.
+    u8* history[SCREEN_PAIRS];
+    int pairs[SCREEN_PAIRS * SCREEN_PAIRS][2];
+  };
+  Work work{};
+  work.screen = screen;
+  work.format = format;
+  work.in = in;
+  work.inLen = inLen;
+  work.base = (u8*)malloc(16 * inLen);
+  auto Run = [&](int count, TrialFn fn) {
+    if (parallel_) {
+      parallel_(parallelCtx_, count, fn, &work);
+    } else {
+      for (int i = 0; i < count; ++i) {
+        fn(&work, i, this);
+      }
+    }
+  };
+  CounterHistory(format, 1, in, inLen, work.base);
+  u32 weights[3] = { 8, 8, 1 };
+  screen->baseCost = HistoryCost(in, inLen, &work.base, &weights[2], 1);
+
+  Run(screen->count, [](void* arg, int i, Compressor* c) {
+    Work* w = (Work*)arg;
+    u8* history[2] = { (u8*)malloc(16 * w->inLen), w->base };
+    u32 weights[2] = { 8, 1 };
+    c->CounterHistory(w->format, w->screen->masks[i], w->in, w->inLen, history[0]);
+    w->screen->cost[i] = HistoryCost(w->in, w->inLen, history, weights, 2);
+    free(history[0]);
+  });
+  for (int i = 1; i < screen->count; ++i) {
+    for (int j = i; j > 0 && screen->cost[j] < screen->cost[j - 1]; --j) {
+      std::swap(screen->cost[j], screen->cost[j - 1]);
+      std::swap(screen->masks[j], screen->masks[j - 1]);
+    }
+  }
+
+  // Pairs of the best masks, from histories kept for the purpose.
+  screen->pairCount = std::min(screen->count, SCREEN_PAIRS);
+  for (int i = 0; i < screen->pairCount; ++i) {
+    work.history[i] = (u8*)malloc(16 * inLen);
+  }
+  Run(screen->pairCount, [](void* arg, int i, Compressor* c) {
+    Work* w = (Work*)arg;
+    c->CounterHistory(w->format, w->screen->masks[i], w->in, w->inLen, w->history[i]);
+  });
+  int pairCount = 0;
+  for (int a = 0; a < screen->pairCount; ++a) {
+    screen->interaction[a][a] = 0;
+    for (int b = a + 1; b < screen->pairCount; ++b) {
+      work.pairs[pairCount][0] = a;
+      work.pairs[pairCount++][1] = b;
+    }
+  }
+  Run(pairCount, [](void* arg, int i, Compressor*) {
+    Work* w = (Work*)arg;
+    Screening* s = w->screen;
+    int a = w->pairs[i][0], b = w->pairs[i][1];
+    const u8* history[3] = { w->history[a], w->history[b], w->base };
+    u32 weights[3] = { 8, 8, 1 };
+    double cost = HistoryCost(w->in, w->inLen, history, weights, 3);
+    s->interaction[a][b] = s->interaction[b][a] = s->cost[a] + s->cost[b] - s->baseCost - cost;
+  });
+  for (int i = 0; i < screen->pairCount; ++i) {
+    free(work.history[i]);
+  }
+  free(work.base);
+}
+
+// Records the counter pair mask alone predicts each bit of in from, two bytes
+// per bit, counting as CompressSingle does. Slots are found by hashing, with
+// room for a flag so that a zero context is told apart from an empty slot.
+// MODEL_MIX is screened with the counters of MODEL_BIT.
+void Compressor::CounterHistory(int format, u8 mask, const u8* in, int inLen, u8* history) {
+  bool bytewise = format == MODEL_BYTE;
+  u32 slotSize = bytewise ? 4 + 2 * 256 : 8;  // Context, flag, then the counters from offset 6.
+  u32 slots = 1, shift = 32;
+  while (slots < 2 * 8 * (u32)inLen && 2 * slots * slotSize <= sizeof(modelCounters_)) {
+    slots *= 2;
+    --shift;
+  }
+  memset(modelCounters_, 0, slots * slotSize);
+  byteSlotsValid_ = false;
+  u32 used = 0;
+
+  u8 tbuf[8] = {1, 0, 0, 0, 0, 0, 0, 0};
+  u8* slot = modelCounters_;
+  for (int j = 0; j < inLen; ++j) {
+    for (int i = 0; i < 8; ++i) {
+      if (!bytewise || i == 0) {
+        u32 off = 0;
+        if (IsStride(mask)) {
+          off = StrideKey(mask, tbuf[0], in, j);
+        } else {
+          for (int b = 0; b < 8; ++b) {
+            if (mask & (1 << b)) {
+              off = (off << 8) + tbuf[b];
+            }
+          }
+        }
+        if (used >= slots / 4 * 3) {  // Only on inputs far too large for the stubs.
+          memset(modelCounters_, 0, slots * slotSize);
+          used = 0;
+        }
+        u32 c = shift < 32 ? (off * 2654435761u) >> shift : 0;
+        slot = &modelCounters_[c * slotSize];
+        while (slot[4] && *(u32*)slot != off) {
+          c = (c + 1) & (slots - 1);
+          slot = &modelCounters_[c * slotSize];
+        }
+        if (!slot[4]) {
+          *(u32*)slot = off;
+          slot[4] = 1;
+          ++used;
+        }
+      }
+      u8* cp = bytewise ? slot + 4 + 2 * tbuf[0] : slot + 6;
+      int y = (in[j] >> (7 - i)) & 1;
+      *history++ = cp[0];
+      *history++ = cp[1];
+      if (cp[y] < 255)
+        ++cp[y];
+      if (cp[1 - y] > 2)
+        cp[1 - y] = cp[1 - y] / 2 + 1;
+      tbuf[0] += tbuf[0] + y;
+      if (i == 7) {
+        memmove(&tbuf[1], &tbuf[0], 7);
+        tbuf[0] = 1;
+      }
+    }
+  }
+}
+
+// The cost in bits of every bit, summed for the parameters as they are and
+// for each change Compressor::Contributions reports on.
+struct ContributionStats {
+  const CompressionParameters* params;
+  double full;
+  double dropped[MAX_CONTEXT_COUNT];
+  double lower[MAX_CONTEXT_COUNT];
+  double higher[MAX_CONTEXT_COUNT];
+  u32 step[MAX_CONTEXT_COUNT];
+
+  static double Cost(u32 n0, u32 n1, int y) { return log2((double)(n0 + n1) / (y ? n1 : n0)); }
+  static double MixCost(int p1, int y) { return log2(4096.0 / (y ? p1 : 4096 - p1)); }
+
+  // Adds a bit coded from the counter pair of each context.
+  void AddCounters(u8* const* pairs, u32 n0, u32 n1, int y) {
+    full += Cost(n0, n1, y);
+    for (int m = 0; m < params->contextCount; ++m) {
+      u32 w = params->weights[m], c0 = pairs[m][0], c1 = pairs[m][1];
+      dropped[m] += Cost(n0 - c0 * w, n1 - c1 * w, y);
+      lower[m] += Cost(n0 - c0 * step[m], n1 - c1 * step[m], y);
+      higher[m] += Cost(n0 + c0 * step[m], n1 + c1 * step[m], y);
+    }
+  }
+
+  // Adds a bit coded by the mixer, from the inputs and weights it had.
+  void AddMix(const int* st, const int* w, int p1, int y) {
+    double cost = MixCost(p1, y);
+    full += cost;
+    u32 dot = 0;
+    for (int m = 0; m < params->contextCount; ++m) {
+      dot += (u32)(((s64)st[m] * w[m]) >> 16);
+    }
+    for (int m = 0; m < params->contextCount; ++m) {
+      int x = (int)(dot - (u32)(((s64)st[m] * w[m]) >> 16) + 2047);
+      if (x > 4094) x = 4094;
+      if (x < 0) x = 0;
+      dropped[m] += MixCost(mixTables.squash[x], y);
+      lower[m] += cost;
+      higher[m] += cost;
+    }
+  }
+};
+
+void Compressor::Contributions(CompressionParameters* params, const void* in, int inLen, ContextReport* report) {
+  ContributionStats stats;
+  memset(&stats, 0, sizeof(stats));
+  stats.params = params;
+  for (int m = 0; m < params->contextCount; ++m) {
+    stats.step[m] = params->format == MODEL_MIX ? 0 : params->weights[m] < 8 ? 1 : params->weights[m] / 4;
+  }
+  stats_ = &stats;
+  TrialSize(params, in, inLen);
+  stats_ = nullptr;
+  report->size = stats.full / 8;
+  for (int m = 0; m < params->contextCount; ++m) {
+    report->dropped[m] = (stats.dropped[m] - stats.full) / 8;
+    report->weightStep[m] = stats.step[m];
+    report->lower[m] = (stats.lower[m] - stats.full) / 8;
+    report->higher[m] = (stats.higher[m] - stats.full) / 8;
+  }
+}
+
+// Drops the context that pays for itself least, as long as one does not,
+// and a real compression agrees with the estimate of Contributions.
+void Compressor::Prune(CompressionParameters* params, void* in, int inLen) {
+  int size = TrialSize(params, in, inLen);
+  while (params->contextCount > MIN_CONTEXT_COUNT) {
+    ContextReport report;
+    Contributions(params, in, inLen, &report);
+    double cost[MAX_CONTEXT_COUNT];
+    int worst = -1;
+    for (int m = 0; m < params->contextCount; ++m) {
+      // Its weight and mask, and its share of the startup work as Search counts it.
+      cost[m] = 2;
+      if (startupWeight_ > 0) {
+        u64 steps = MaskSteps(params->format, params->contexts[m], in, inLen);
+        cost[m] += startupWeight_ * (steps + (u64)inLen * 8) / 1000000;
+      }
+      if (report.dropped[m] >= cost[m]) continue;
+      if (worst < 0 || report.dropped[m] - cost[m] < report.dropped[worst] - cost[worst]) worst = m;
+    }
+    if (worst < 0) break;
+    CompressionParameters pruned = *params;
+    int n = --pruned.contextCount;
+    memmove(&pruned.contexts[worst], &pruned.contexts[worst + 1], n - worst);
+    memmove(&pruned.weights[worst], &pruned.weights[worst + 1], n - worst);
+    int prunedSize = TrialSize(&pruned, in, inLen);
+    if (prunedSize - size >= cost[worst]) break;
+    if (!quiet_) {
+      printf("Pruned %2d*%2.2x: %+d bytes of data, %.1f bytes of costs less\n", params->weights[worst],
+             params->contexts[worst], prunedSize - size, cost[worst]);
+    }
+    *params = pruned;
+    size = prunedSize;
+  }
+}
+
+// Refine keeps the counter histories of all usable masks up to this size.
+#define REFINE_CACHE (64 << 20)
+
+// Takes the step to the neighbour of params that costs least, as long as one
+// costs less: a weight one higher or lower, or a mask swapped for one of the
+// usable masks. Every context keeps its counter history, and the histories of
+// the others do not depend on it, so a neighbour costs one pass over the
+// totals of all contexts, plus the history of the mask swapped in. Costs are
+// estimates without the rounding of the coder, so the result is only kept if
+// a real compression agrees. MODEL_MIX is left as it is: its mixer weights
+// depend on every context.
+void Compressor::Refine(CompressionParameters* params, void* in, int inLen) {
+  if (params->format == MODEL_MIX) return;
+  struct Work {
+    CompressionParameters* params;
+    const u8* in;
+    int inLen;
+    u32* totals;
+    u8* history[MAX_CONTEXT_COUNT];
+    u8 masks[255];
+    u8* cached[255];  // Histories of the masks, kept if they all fit in REFINE_CACHE bytes.
+    bool cache;
+    double startup[256];  // Bits each mask costs in startup work, as Search weighs it.
+    double cost[255];  // Best cost with the mask swapped in, at context best[i].
+    int best[255];
+  };
+  Work* work = new Work;
+  work->params = params;
+  work->in = (const u8*)in;
+  work->inLen = inLen;
+  work->totals = (u32*)malloc(16 * inLen * sizeof(u32));
+  int count = UsableMasks(strides_, work->masks);
+  memset(work->cached, 0, sizeof(work->cached));
+  work->cache = (u64)16 * inLen * count <= REFINE_CACHE;
+  for (int i = 0; i < count + params->contextCount; ++i) {
+    u8 mask = i < count ? work->masks[i] : params->contexts[i - count];
+    work->startup[mask] =
+        startupWeight_ > 0 ? 8 * startupWeight_ * MaskSteps(params->format, mask, in, inLen) / 1000000 : 0;
+  }
+  for (int m = 0; m < params->contextCount; ++m) {
+    work->history[m] = (u8*)malloc(16 * inLen);
+    CounterHistory(params->format, params->contexts[m], work->in, inLen, work->history[m]);
+  }
+
+  CompressionParameters start = *params;
+  int steps = 0;
+  for (;;) {
+    for (int b = 0; b < 16 * inLen; ++b) {
+      work->totals[b] = 1;
+      for (int m = 0; m < params->contextCount; ++m) {
+        work->totals[b] += work->history[m][b] * params->weights[m];
+      }
+    }
+    double cost = SwapCost(work->in, inLen, work->totals, work->history[0], 0, work->history[0], 0);
+    double bestCost = cost;
+    int bestContext = -1, bestWeight = 0, bestMask = -1;
+    for (int m = 0; m < params->contextCount; ++m) {
+      for (int w = params->weights[m] - 1; w <= params->weights[m] + 1; w += 2) {
+        if (w < 1 || w > MAX_WEIGHT) continue;
+        double c = SwapCost(work->in, inLen, work->totals, work->history[m], params->weights[m], work->history[m], w);
+        if (c < bestCost) {
+          bestCost = c;
+          bestContext = m;
+          bestWeight = w;
+        }
+      }
+    }
+    if (bestContext >= 0) {  // Weights are cheap to try, sweep the masks once they settle.
+      params->weights[bestContext] = bestWeight;
+      ++steps;
+      continue;
+    }
+    TrialFn swap = [](void* arg, int i, Compressor* c) {
+      Work* w = (Work*)arg;
+      CompressionParameters* params = w->params;
+      w->best[i] = -1;
+      for (int m = 0; m < params->contextCount; ++m) {
+        if (params->contexts[m] == w->masks[i]) return;
+      }
+      u8* history = w->cached[i];
+      if (!history) {
+        history = (u8*)malloc(16 * w->inLen);
+        c->CounterHistory(params->format, w->masks[i], w->in, w->inLen, history);
+      }
+      for (int m = 0; m < params->contextCount; ++m) {
+        double cost = SwapCost(w->in, w->inLen, w->totals, w->history[m], params->weights[m], history,
+                               params->weights[m]) +
+                      w->startup[w->masks[i]] - w->startup[params->contexts[m]];
+        if (w->best[i] < 0 || cost < w->cost[i]) {
+          w->best[i] = m;
+          w->cost[i] = cost;
+        }
+      }
+      if (w->cache) {
+        w->cached[i] = history;
+      } else {
+        free(history);
+      }
+    };
+    if (parallel_) {
+      parallel_(parallelCtx_, count, swap, work);
+    } else {
+      for (int i = 0; i < count; ++i) {
+        swap(work, i, this);
+      }
+    }
+    for (int i = 0; i < count; ++i) {
+      if (work->best[i] >= 0 && work->cost[i] < bestCost) {
+        bestCost = work->cost[i];
+        bestContext = work->best[i];
+        bestMask = work->masks[i];
+      }
+    }
+    if (bestContext < 0) break;  // No neighbour costs less.
+    params->contexts[bestContext] = bestMask;
+    CounterHistory(params->format, bestMask, work->in, inLen, work->history[bestContext]);
+    ++steps;
+  }
+  for (int m = 0; m < params->contextCount; ++m) {
+    free(work->history[m]);
+  }
+  for (int i = 0; i < count; ++i) {
+    free(work->cached[i]);
+  }
+  free(work->totals);
+  delete work;
+
+  if (!steps) return;
+  double startCost = TrialSize(&start, in, inLen), refinedCost = TrialSize(params, in, inLen);
+  if (startupWeight_ > 0) {
+    startCost += startupWeight_ * ProbeSteps(&start, in, inLen) / 1000000;
+    refinedCost += startupWeight_ * ProbeSteps(params, in, inLen) / 1000000;
+  }
+  if (refinedCost >= startCost) *params = start;
+  if (!quiet_) {
+    printf("Refine: local optimum after %d steps, %.1f bytes gained%s%s\n", steps, startCost - refinedCost,
+           startupWeight_ > 0 ? " counting startup work" : "",
+           refinedCost >= startCost ? ", kept the parameters of the search" : "");
+  }
+}
+
+bool Compressor::Optimize(CompressionParameters* params, const void* in, int inLen, ProgressFn progress, void* ctx,
+                          const std::atomic<bool>* cancel) {
+  if (!Search(params, in, inLen, progress, ctx, cancel)) return false;
+  Refine(params, (void*)in, inLen);
+  if (prune_) Prune(params, (void*)in, inLen);
+  return true;
+}
+
 bool Compressor::Compress(CompressionParameters* params, void* in, int inLen, void* out, int* outLen) {
+  Optimize(params, in, inLen, progress_, progressCtx_, nullptr);
+
+  if (CompressSingle(params, in, inLen, out, outLen)) {
+    if (quiet_) return true;
+    printf("Final: %d", *outLen);
+    for (int i = 0; i < params->contextCount; ++i) {
+      printf(" %2d*%2.2x", params->weights[i], params->contexts[i]);
+    }
+    printf("\n");
+    printf("cmax: %d\n", cmax_);
+    u32 distinct[MAX_CONTEXT_COUNT];
+    printf("Startup: %llu probe steps, contexts per table:", ProbeSteps(params, in, inLen, distinct));
+    for (int i = 0; i < params->contextCount; ++i) {
+      printf(" %u", distinct[i]);
+    }
+    printf("\n");
+    ContextReport report;
+    Contributions(params, in, inLen, &report);
+    for (int i = 0; i < params->contextCount; ++i) {
+      printf("Context %2d*%2.2x: %+8.1f bytes without it", params->weights[i], params->contexts[i], report.dropped[i]);
+      if (report.weightStep[i]) {
+        printf(", %+6.1f at weight %d, %+6.1f at weight %d", report.lower[i], params->weights[i] - report.weightStep[i],
+               report.higher[i], params->weights[i] + report.weightStep[i]);
+      }
+      printf("\n");
+    }
+    char buf[128];
+    params->ToString(buf);
+    printf("Params: %s\n", buf);
+    return true;
+  }
+  printf("Failed, for some reason could not recompress with optimal settings\n");
+  return false;
+}
+
+bool Compressor::Search(CompressionParameters* params, const void* data, int inLen, ProgressFn progress,
+                        void* ctx, const std::atomic<bool>* cancel) {
+  void* in = (void*)data;
+  CompressionParameters* trialParams[GENOME_SIZE > 128 ? GENOME_SIZE : 128];
+  int* trialSizes[GENOME_SIZE > 128 ? GENOME_SIZE : 128];
+  u32 random = (u32)time(nullptr) ^ (u32)(size_t)this;
+  if (!random) random = 1;
+
   // Test all context patterns individually to figure out which ones are most
-  // likely to produce good results for seeding our initial set.
-  Context pats[128];
+  // likely to produce good results for seeding our initial set, unless an
+  // earlier search ranked them already.
+  Context pats[255];
+  Screening screen;
   u32 pc = 0;
-  int orgOutLen = *outLen;
-  for (u32 i = 3; i < 256; i += 2) {
-    u32 bc = 0;
-    for (u8 b = 0; b < 8; ++b) {
-      if (i & (1 << b)) ++bc;
-    }
-    if (bc > 4) continue;  // Only keep patterns with 4 bytes at most.
-    pats[pc].ctx = i;
-    pats[pc].bs = *outLen;
-    pats[pc].bw = 0;
-    CompressionParameters c;
-    c.contextCount = 2;
-    c.weights[0] = 8;
-    c.weights[1] = 1;
-    c.contexts[0] = pats[pc].ctx;
-    c.contexts[1] = 1;
-    CompressSingle(&c, in, inLen, out, &pats[pc].bs);
-    ++pc;
-  }
-  qsort(pats, pc, sizeof(Context), (__compar_fn_t)CompareContext);
+  if (ranking_ && ranking_->count) {
+    for (pc = 0; pc < (u32)ranking_->count; ++pc) {
+      pats[pc].ctx = ranking_->masks[pc];
+      pats[pc].bs = 0;
+      pats[pc].bw = 0;
+    }
+  } else {
+    Screen(params->format, (const u8*)in, inLen, &screen);
+    for (pc = 0; pc < (u32)screen.count; ++pc) {
+      pats[pc].ctx = screen.masks[pc];
+      pats[pc].bs = (int)(screen.cost[pc] / 8);
+      pats[pc].bw = 0;
+    }
+    if (!quiet_ && screen.pairCount > 1) {
+      int a = 0, b = 1;
+      for (int i = 0; i < screen.pairCount; ++i) {
+        for (int j = i + 1; j < screen.pairCount; ++j) {
+          if (screen.interaction[i][j] > screen.interaction[a][b]) {
+            a = i;
+            b = j;
+          }
+        }
+      }
+      printf("Screened %d masks, best pair %2.2x+%2.2x: %+.1f bytes from their interaction\n", screen.count,
+             screen.masks[a], screen.masks[b], screen.interaction[a][b] / 8);
+    }
+    if (ranking_) {
+      for (u32 i = 0; i < pc; ++i) {
+        ranking_->masks[i] = pats[i].ctx;
+      }
+      ranking_->count = pc;
+    }
+  }
   if (verbose_) {
     for (int i = 0; i < pc; ++i) {
       printf("Pattern %2d [%2.2x] = %d bytes @ %d\n", i, pats[i].ctx, pats[i].bs, pats[i].bw);
     }  
   }
 
+  // All but the first genome draw three in four masks from the prior, if
+  // there is one for this format, and center their context count on it.
+  const ContextPrior* prior = prior_ && prior_->count && prior_->format == params->format ? prior_ : nullptr;
+  ContextPrior withoutStrides;
+  if (prior && !strides_) {
+    withoutStrides = *prior;
+    withoutStrides.count = 0;
+    for (int i = 0; i < prior->count; ++i) {
+      if (IsStride(prior->masks[i])) continue;
+      withoutStrides.masks[withoutStrides.count] = prior->masks[i];
+      withoutStrides.hits[withoutStrides.count] = prior->hits[i];
+      withoutStrides.weights[withoutStrides.count++] = prior->weights[i];
+    }
+    prior = withoutStrides.count ? &withoutStrides : nullptr;
+  }
+  u32 priorTotal = 0;
+  int contextCount = CONTEXT_COUNT;
+  if (prior) {
+    for (int i = 0; i < prior->count; ++i) {
+      priorTotal += prior->hits[i];
+    }
+    contextCount = prior->contextCount;
+    if (contextCount < MIN_CONTEXT_COUNT + 3) contextCount = MIN_CONTEXT_COUNT + 3;
+    if (contextCount > MAX_CONTEXT_COUNT - 3) contextCount = MAX_CONTEXT_COUNT - 3;
+    if (!quiet_) {
+      printf("Drawing the first population from a prior of %d masks from %d inputs\n", prior->count, prior->inputs);
+    }
+  }
+
   Genome* g = new Genome[GENOME_SIZE];
   for (int i = 0; i < GENOME_SIZE; ++i) {
-    g[i].params.contextCount = CONTEXT_COUNT;
-    g[i].params.contexts[0] = 1;
-    g[i].params.weights[0] = 1;
-    for (int j = 1; j < CONTEXT_COUNT; ++j) {
-      if (i == 0) {
-        g[i].params.contexts[j] = pats[j - 1].ctx;
-        g[i].params.weights[j] = 20;
-      } else {
-        g[i].params.contexts[j] = pats[rand() % (pc / 4)].ctx;
-        g[i].params.weights[j] = rand() % MAX_WEIGHT + 1;
-      }
-    }
+    SeedGenome(&g[i].params, params->format, i == 0, contextCount, pats, pc, prior, priorTotal, &random);
+    g[i].size = -1;
   }
+  PickInteracting(&g[0].params, &screen);
   if (params->contextCount) {
     g[1].params = *params;
   }
+  Genome front[FRONT_SIZE];
+  int frontCount = 0;
+  bool cancelled = false;
+  int best = 0x7fffffff, bestEvaluations = 0, lastImprovement = 0, restarts = 0;
+  int mutations = 3;  // Per mutated copy, more while the search stalls.
+  int evaluations = 0, generations = 0;
   for (int i = 0; i < GENOME_ITERATIONS; ++i) {
+    // Genomes that did not change since the last generation keep their size.
+    int changed[GENOME_SIZE];
+    int count = 0;
     for (int j = 0; j < GENOME_SIZE; ++j) {
-      g[j].fitness = *outLen;
-      CompressSingle(&g[j].params, in, inLen, out, &g[j].fitness);
+      if (g[j].size >= 0) continue;
+      trialParams[count] = &g[j].params;
+      trialSizes[count] = &g[j].size;
+      changed[count++] = j;
+    }
+    Trials(trialParams, trialSizes, count, in, inLen);
+    evaluations += count;
+    ++generations;
+    for (int j = 0; j < count; ++j) {
+      Genome& n = g[changed[j]];
+      // Every context also costs its weight and mask in the output, and
+      // decoding time for every bit.
+      n.fitness = n.size + 2 * n.params.contextCount;
+      if (startupWeight_ > 0) {
+        n.steps = ProbeSteps(&n.params, in, inLen);
+        u64 updates = (u64)inLen * 8 * n.params.contextCount;
+        n.fitness += (int)(startupWeight_ * (n.steps + updates) / 1000000);
+        AddToFront(front, &frontCount, n);
+      }
     }
     qsort(g, GENOME_SIZE, sizeof(Genome), (__compar_fn_t)CompareGenome);
     for (int j = 0; j < GENOME_SIZE; ++j) {
-      if (j >= 3) break;
+      if (j >= 3 || quiet_) break;
       printf("I[%3d,%d]: %d", i, j, g[j].fitness);
+      if (startupWeight_ > 0) {
+        printf(" (%d bytes, %llu steps)", g[j].size, g[j].steps);
+      }
       for (int i = 0; i < g[j].params.contextCount; ++i) {
         printf(" %2d*%2.2x", g[j].params.weights[i], g[j].params.contexts[i]);
       }
       printf("\n");
     }
     *params = g[0].params;
-    srand(time(nullptr));
+    if (progress) progress(ctx, i + 1, GENOME_ITERATIONS, g[0].fitness);
+    if (cancel && *cancel) {
+      cancelled = true;
+      break;
+    }
+
+    // Mutate less while the best genome improves, more while it does not.
+    if (g[0].fitness < best) {
+      best = g[0].fitness;
+      bestEvaluations = evaluations;
+      lastImprovement = i;
+      if (mutations > 1) --mutations;
+    } else if ((i - lastImprovement) % 4 == 0 && mutations < MAX_MUTATIONS) {
+      ++mutations;
+    }
+    int stall = i - lastImprovement;
+    int distinct = DistinctGenomes(g, GENOME_SIZE);
+    if (stall >= STALL_GENERATIONS || distinct < GENOME_SIZE / 4) {
+      if (restarts == MAX_RESTARTS) break;
+      // Keep the best genomes and start over around them.
+      ++restarts;
+      lastImprovement = i;
+      mutations = 3;
+      if (verbose_) {
+        printf("Restart %d after generation %d, %d distinct genomes\n", restarts, i, distinct);
+      }
+      for (int j = RESTART_KEEP; j < GENOME_SIZE; ++j) {
+        SeedGenome(&g[j].params, params->format, false, contextCount, pats, pc, prior, priorTotal, &random);
+        g[j].size = -1;
+      }
+      continue;
+    }
+
+    // Crossover fills the second quarter while the search improves, and
+    // gives half of it to mutated copies once it stalls.
     int keep = GENOME_SIZE / 4;
-    for (int j = 0; j < GENOME_SIZE; ++j) {
-      g[j].fitness = 0;
-    }
-    for (int j = keep; j < GENOME_SIZE / 2; j += 2) {
-      int m1 = rand() % keep;
-      int m2 = rand() % keep;
-      while (m2 == m1) { m2 = rand() % keep; }
-      int cb = rand() % (CONTEXT_COUNT * 2);
-      bool equals = true;
-      for (int k = 0; k < 2 * CONTEXT_COUNT; ++k) {
+    int crossEnd = stall > STALL_GENERATIONS / 3 ? keep + keep / 2 : GENOME_SIZE / 2;
+    for (int j = keep; j < crossEnd; j += 2) {
+      int m1 = Random(&random) % keep;
+      int m2 = Random(&random) % keep;
+      while (m2 == m1) { m2 = Random(&random) % keep; }
+      // Each child keeps the number of contexts of one parent, and takes
+      // the contexts the other parent does not have from that one.
+      int n1 = g[m1].params.contextCount, n2 = g[m2].params.contextCount;
+      g[j].params.contextCount = n1;
+      g[j + 1].params.contextCount = n2;
+      int cb = Random(&random) % (2 * (n1 < n2 ? n1 : n2));
+      for (int k = 0; k < 2 * MAX_CONTEXT_COUNT; ++k) {
         u8* trg1 = (k & 1) ? g[j].params.contexts : g[j].params.weights;
         u8* trg2 = (k & 1) ? g[j + 1].params.contexts : g[j + 1].params.weights;
         u8* src1 = (k & 1) ? g[m1].params.contexts : g[m1].params.weights;
         u8* src2 = (k & 1) ? g[m2].params.contexts : g[m2].params.weights;
-        if (k >= cb) {
+        if (k >= cb && (k >> 1) < n1 && (k >> 1) < n2) {
           u8* tmp = src1;
           src1 = src2;
           src2 = tmp;
@@ -188,61 +1114,72 @@ bool Compressor::Compress(CompressionParameters* params, void* in, int inLen, vo
         trg1[k >> 1] = src1[k >> 1];
         trg2[k >> 1] = src2[k >> 1];
       }
+      g[j].size = -1;
+      g[j + 1].size = -1;
     }
-    qsort(g, GENOME_SIZE / 2, sizeof(Genome), (__compar_fn_t)CompareGenome);
-    for (int j = 1; j < GENOME_SIZE / 2; ++j) {
-      if (!memcmp(g[j].params.weights, g[j - 1].params.weights, CONTEXT_COUNT) && !memcmp(g[j].params.contexts, g[j - 1].params.contexts, CONTEXT_COUNT)) {
-        int byte = rand() % (2 * CONTEXT_COUNT);
-        if (byte < CONTEXT_COUNT) {
-          g[j - 1].params.contexts[byte] = pats[rand() % pc].ctx;
-        } else {
-          g[j - 1].params.weights[byte - CONTEXT_COUNT] = rand() % MAX_WEIGHT + 1;
+    // Duplicates in the first half only waste trials, mutate them.
+    for (int j = 1; j < crossEnd; ++j) {
+      for (int k = 0; k < j; ++k) {
+        if (SameParams(g[j].params, g[k].params)) {
+          Mutate(&g[j].params, pats, pc, &screen, &random);
+          g[j].size = -1;
+          break;
         }
       }
     }
-    for (int j = GENOME_SIZE / 2; j < GENOME_SIZE; ++j) {
+    for (int j = crossEnd; j < GENOME_SIZE; ++j) {
       memcpy(&g[j], &g[j % keep], sizeof(Genome));
-      int limit = 1;
-      if (j > 3 * GENOME_SIZE / 4)
-        limit = 3;
-      for (int k = 0; k < 3; ++k) {
-        // Mutation.
-        int byte = rand() % (2 * CONTEXT_COUNT);
-        if (byte < CONTEXT_COUNT) {
-          g[j].params.contexts[byte] = pats[rand() % pc].ctx;
-        } else {
-          g[j].params.weights[byte - CONTEXT_COUNT] = rand() % MAX_WEIGHT + 1;
-        }
+      for (int k = 0; k < mutations; ++k) {
+        Mutate(&g[j].params, pats, pc, &screen, &random);
       }
+      g[j].size = -1;
     }
   }
+  if (!quiet_) {
+    int budget = GENOME_ITERATIONS * GENOME_SIZE;
+    printf("Search: %d generations, %d restarts, %d of %d evaluations (%d%% saved), best fitness %d after %d\n",
+           generations, restarts, evaluations, budget, 100 - 100 * evaluations / budget, best, bestEvaluations);
+  }
 
   delete[] g;
 
-  if (CompressSingle(params, in, inLen, out, outLen)) {
-    printf("Final: %d", *outLen);
-    for (int i = 0; i < params->contextCount; ++i) {
-      printf(" %2d*%2.2x", params->weights[i], params->contexts[i]);
+  if (frontCount && !quiet_) {
+    qsort(front, frontCount, sizeof(Genome), (__compar_fn_t)CompareFront);
+    for (int i = 0; i < frontCount; ++i) {
+      char buf[128];
+      front[i].params.ToString(buf);
+      printf("Front: %d bytes, %llu steps, %s\n", front[i].size, front[i].steps, buf);
     }
-    printf("\n");
-    printf("cmax: %d\n", cmax);
-    char buf[128];
-    params->ToString(buf);
-    printf("Params: %s\n", buf);
-    return true;
   }
-  printf("Failed, for some reason could not recompress with optimal settings\n");
-  return false;
+
+  return !cancelled;
 }
 
 bool Compressor::CompressSingle(CompressionParameters* comp, void* in, int inLen, void* out, int* outLen) {
+  Segment segment;
+  segment.params = *comp;
+  return CompressSegments(&segment, 1, in, inLen, out, outLen);
+}
+
+bool Compressor::CompressSegments(const Segment* segments, int count, void* in, int inLen, void* out, int* outLen) {
+  if (segments[0].params.format == MODEL_BYTE) {
+    return CompressSegmentsByte(segments, count, in, inLen, out, outLen);
+  }
+  const CompressionParameters* comp = &segments[0].params;
+  int next = 1;  // Segment to switch to.
   u8* archive = (u8*)in;
   u8* output;
   u8* counters[MAX_CONTEXT_COUNT];  // Counter base offsets
   u8* cp[MAX_CONTEXT_COUNT];  // Current counters
   u8 tbuf[8] = {1, 0, 0, 0, 0, 0, 0, 0};
+  bool mix = comp->format == MODEL_MIX;
+  int w[MAX_CONTEXT_COUNT], st[MAX_CONTEXT_COUNT], p1 = 0;
+  for (int m = 0; m < comp->contextCount; ++m) {
+    w[m] = comp->weights[m] << 10;
+  }
 
   memset(modelCounters_, 0, MAX_CONTEXT_SIZE * comp->contextCount);
+  byteSlotsValid_ = false;
   u8* base = modelCounters_; 
   for (int m = 0; m < comp->contextCount; ++m) {
     counters[m] = base;
@@ -255,14 +1192,18 @@ bool Compressor::CompressSingle(CompressionParameters* comp, void* in, int inLen
   for (int j = 0; j < inLen; ++j) {
     u32 byte = *archive++;
     for (u32 i = 0; i < 8; ++i) {
-      u32 n0 = 1, n1 = 1;
-      for (int m = 0; m < comp->contextCount; ++m) {
-        n0 += cp[m][0] * comp->weights[m];
-        n1 += cp[m][1] * comp->weights[m];
+      u32 xmid, n0 = 1, n1 = 1;
+      if (mix) {
+        p1 = MixPredict(comp->contextCount, cp, w, st);
+        xmid = MixSplit(x1, x2, p1);
+      } else {
+        for (int m = 0; m < comp->contextCount; ++m) {
+          n0 += cp[m][0] * comp->weights[m];
+          n1 += cp[m][1] * comp->weights[m];
+        }
+        xmid = RangeSplit(x1, x2, n0, n1);
       }
 
-      u32 xmid = x1 + n0 * (u64)(x2 - x1) / (n0 + n1); 
-
       int y;
       if (byte & 0x80) {
         x1 = xmid + 1;
@@ -271,6 +1212,13 @@ bool Compressor::CompressSingle(CompressionParameters* comp, void* in, int inLen
         x2 = xmid;
         y = 0;
       }
+      if (stats_) {
+        if (mix) {
+          stats_->AddMix(st, w, p1, y);
+        } else {
+          stats_->AddCounters(cp, n0, n1, y);
+        }
+      }
 
       // Store bit y 
       tbuf[0] += tbuf[0] + y;
@@ -283,24 +1231,33 @@ bool Compressor::CompressSingle(CompressionParameters* comp, void* in, int inLen
         tbuf[2] = tbuf[1];
         tbuf[1] = tbuf[0];
         tbuf[0] = 1;
+        // The contexts of the next byte are those of its segment.
+        if (next < count && j + 1 == segments[next].start) comp = &segments[next++].params;
       }
 
       // Count y by context
+      if (mix) MixUpdate(comp->contextCount, cp, w, st, y, p1);
       for (int m = comp->contextCount - 1; m >= 0; --m) {
-        if (cp[m][y] < 255)
-          ++cp[m][y];
-        if (cp[m][1-y] > 2)
-          cp[m][1-y] = cp[m][1-y] / 2 + 1;
+        if (!mix) {
+          if (cp[m][y] < 255)
+            ++cp[m][y];
+          if (cp[m][1-y] > 2)
+            cp[m][1-y] = cp[m][1-y] / 2 + 1;
+        }
         u32 off = 0, cnt = 0;
-        for (char i = 0; i < 8; ++i) {
-          if (comp->contexts[m] & (1 << i)) {
-            off = (off << 8) + tbuf[i];
+        if (IsStride(comp->contexts[m])) {
+          off = StrideKey(comp->contexts[m], tbuf[0], (u8*)in, i == 7 ? j + 1 : j);
+        } else {
+          for (char i = 0; i < 8; ++i) {
+            if (comp->contexts[m] & (1 << i)) {
+              off = (off << 8) + tbuf[i];
+            }
           }
         }
         // Use a sort of hashtable here. Decompressor just uses c = 0.
         u32 c = 24 * ((off & 0xffff) ^ (off >> 16));
         while (*(u32*)&counters[m][c] != 0 && *(u32*)&counters[m][c] != off) c += 6;
-        if (c > cmax) cmax = c;
+        if (c > cmax_) cmax_ = c;
         *(u32*)&counters[m][c] = off;
         cp[m] = &counters[m][c + 4];
       }
@@ -332,3 +1289,398 @@ bool Compressor::CompressSingle(CompressionParameters* comp, void* in, int inLen
   return true;
 }
 
+
+u8* Compressor::ClearByteSlots() {
+  if (byteSlotsValid_) {
+    for (u32 i = 0; i < byteSlotCount_; ++i) {
+      memset(&modelCounters_[byteSlots_[i]], 0, BYTE_SLOT_SIZE);
+    }
+  } else {
+    memset(modelCounters_, 0, sizeof(modelCounters_));
+  }
+  byteSlotCount_ = 0;
+  byteSlotsValid_ = true;
+  return modelCounters_;
+}
+
+bool Compressor::CompressSegmentsByte(const Segment* segments, int count, void* in, int inLen, void* out,
+                                      int* outLen) {
+  const CompressionParameters* comp = &segments[0].params;
+  int next = 1;  // Segment to switch to.
+  u8* archive = (u8*)in;
+  u8* counters[MAX_CONTEXT_COUNT];  // Slot table base offsets
+  u8* slot[MAX_CONTEXT_COUNT];  // Slots for the current byte
+  u8 tbuf[8] = {1, 0, 0, 0, 0, 0, 0, 0};
+
+  // Split all of modelCounters_ between the contexts, since a slot is much
+  // larger than in the bitwise model.
+  u32 slotCount = sizeof(modelCounters_) / comp->contextCount / BYTE_SLOT_SIZE;
+  u8* base = ClearByteSlots();
+  for (int m = 0; m < comp->contextCount; ++m) {
+    counters[m] = base;
+    base += slotCount * BYTE_SLOT_SIZE;
+  }
+
+  u8* cout = (u8*)out;
+  u32 x1 = 0, x2 = 0xffffffff;
+  for (int j = 0; j < inLen; ++j) {
+    if (next < count && j == segments[next].start) comp = &segments[next++].params;
+    // Find the slot of each context, once per byte. tbuf[0] is always 1 here.
+    for (int m = 0; m < comp->contextCount; ++m) {
+      u32 off = 0;
+      if (IsStride(comp->contexts[m])) {
+        off = StrideKey(comp->contexts[m], tbuf[0], (u8*)in, j);
+      } else {
+        for (int i = 0; i < 8; ++i) {
+          if (comp->contexts[m] & (1 << i)) {
+            off = (off << 8) + tbuf[i];
+          }
+        }
+      }
+      // Same hashtable idea as CompressSingle, the decompressor scans from
+      // slot 0.
+      u32 c = ((off & 0xffff) ^ (off >> 16)) % slotCount;
+      u32 probes = 0;
+      while (*(u32*)&counters[m][c * BYTE_SLOT_SIZE] != 0 && *(u32*)&counters[m][c * BYTE_SLOT_SIZE] != off) {
+        if (++c == slotCount) c = 0;
+        if (++probes == slotCount) return false;
+      }
+      slot[m] = &counters[m][c * BYTE_SLOT_SIZE];
+      if (*(u32*)slot[m] == 0) {
+        if ((int)c > cmax_) cmax_ = c;
+        if (byteSlotCount_ < sizeof(byteSlots_) / sizeof(byteSlots_[0])) {
+          byteSlots_[byteSlotCount_++] = slot[m] - modelCounters_;
+        } else {
+          byteSlotsValid_ = false;
+        }
+      }
+      *(u32*)slot[m] = off;
+    }
+
+    u32 byte = *archive++;
+    for (u32 i = 0; i < 8; ++i) {
+      // The counter pair for partial byte p lives at slot + 4 + 2 * (p - 1).
+      u32 n0 = 1, n1 = 1;
+      u8* pairs[MAX_CONTEXT_COUNT];
+      for (int m = 0; m < comp->contextCount; ++m) {
+        u8* cp = pairs[m] = slot[m] + 2 + 2 * tbuf[0];
+        n0 += cp[0] * comp->weights[m];
+        n1 += cp[1] * comp->weights[m];
+      }
+
+      u32 xmid = RangeSplit(x1, x2, n0, n1);
+
+      int y;
+      if (byte & 0x80) {
+        x1 = xmid + 1;
+        y = 1;
+      } else {
+        x2 = xmid;
+        y = 0;
+      }
+      if (stats_) stats_->AddCounters(pairs, n0, n1, y);
+
+      // Count y by context
+      for (int m = comp->contextCount - 1; m >= 0; --m) {
+        u8* cp = slot[m] + 2 + 2 * tbuf[0];
+        if (cp[y] < 255)
+          ++cp[y];
+        if (cp[1-y] > 2)
+          cp[1-y] = cp[1-y] / 2 + 1;
+      }
+
+      // Store bit y 
+      tbuf[0] += tbuf[0] + y;
+      if (i == 7) {  // Start new byte
+        tbuf[7] = tbuf[6];
+        tbuf[6] = tbuf[5];
+        tbuf[5] = tbuf[4];
+        tbuf[4] = tbuf[3];
+        tbuf[3] = tbuf[2];
+        tbuf[2] = tbuf[1];
+        tbuf[1] = tbuf[0];
+        tbuf[0] = 1;
+      }
+
+      while (((x1 ^ x2) & 0xff000000) == 0) {
+        *cout++ = x2 >> 24;
+        x1 <<= 8;
+        x2 = (x2 << 8) + 255;
+        if (cout - (u8*)out >= *outLen) return false;
+      }
+      byte <<= 1;
+    }
+  }
+  while (((x1 ^ x2) & 0xff000000)==0) {
+    *cout++ = x2 >> 24;
+    x1 <<= 8;
+    x2 = (x2 << 8) + 255;
+    if (cout - (u8*)out >= *outLen) return false;
+  }
+  *cout++ = x2 >> 24;  // First unequal byte
+  // See CompressSingle for why this is needed.
+  if (((x2 >> 16) & 0xff) < 0xc3) {
+    if (cout - (u8*)out >= *outLen) return false;
+    *cout++ = 0;
+  }
+  *outLen = cout - (u8*)out;
+  return true;
+}
+
+u64 Compressor::ProbeSteps(CompressionParameters* params, void* in, int inLen, u32* distinct) {
+  // Callers filter buffers in place, so the input is known by its contents.
+  u64 hash = 0xcbf29ce484222325ull;  // FNV-1a
+  for (int i = 0; i < inLen; ++i) {
+    hash = (hash ^ ((u8*)in)[i]) * 0x100000001b3ull;
+  }
+  if (hash != probeHash_ || inLen != probeInputLen_ || params->format != probeFormat_) {
+    memset(probeValid_, 0, sizeof(probeValid_));
+    probeHash_ = hash;
+    probeInputLen_ = inLen;
+    probeFormat_ = params->format;
+  }
+  // Tables are independent of each other and of the weights, so the cost of
+  // each mask only needs to be measured once.
+  u64 steps = 0;
+  for (int m = 0; m < params->contextCount; ++m) {
+    u8 mask = params->contexts[m];
+    if (!probeValid_[mask]) {
+      probeSteps_[mask] = MaskProbeSteps(params->format, mask, (u8*)in, inLen, &probeContexts_[mask]);
+      probeValid_[mask] = true;
+    }
+    steps += probeSteps_[mask];
+    if (distinct) distinct[m] = probeContexts_[mask];
+  }
+  return steps;
+}
+
+// Appends bit y to the context history in tbuf.
+static void PushBit(u8* tbuf, int y, bool lastBit) {
+  tbuf[0] += tbuf[0] + y;
+  if (lastBit) {  // Start new byte
+    memmove(&tbuf[1], &tbuf[0], 7);
+    tbuf[0] = 1;
+  }
+}
+
+// ProbeSteps of a single mask, from the same cache.
+u64 Compressor::MaskSteps(int format, u8 mask, void* in, int inLen) {
+  CompressionParameters single;
+  single.format = format;
+  single.contextCount = 1;
+  single.contexts[0] = mask;
+  return ProbeSteps(&single, in, inLen);
+}
+
+u64 Compressor::MaskProbeSteps(int format, u8 mask, u8* in, int inLen, u32* distinct) {
+  // Map each context to the position the stub gives it, which is the order in
+  // which contexts are first seen. Entries are {context, position + 1}.
+  u32* table = (u32*)modelCounters_;
+  u32 tableSize = MAX_CONTEXT_SIZE / 8;
+  memset(modelCounters_, 0, MAX_CONTEXT_SIZE);
+  byteSlotsValid_ = false;
+
+  u8 tbuf[8] = {1, 0, 0, 0, 0, 0, 0, 0};
+  u64 steps = 0;
+  u32 count = 0;
+  u32 zeroPos = 0;  // Position + 1 of the zero context, which is also the empty marker.
+  for (int j = 0; j < inLen * 8; ++j) {
+    // The bitwise model looks up a slot after every bit, the byte model
+    // before the first bit of every byte.
+    if (format != MODEL_BYTE) {
+      PushBit(tbuf, (in[j >> 3] >> (7 - (j & 7))) & 1, (j & 7) == 7);
+    } else if (j & 7) {
+      PushBit(tbuf, (in[j >> 3] >> (7 - (j & 7))) & 1, (j & 7) == 7);
+      continue;
+    }
+    u32 off = 0;
+    if (IsStride(mask)) {
+      off = StrideKey(mask, tbuf[0], in, format == MODEL_BYTE ? j >> 3 : (j + 1) >> 3);
+    } else {
+      for (int i = 0; i < 8; ++i) {
+        if (mask & (1 << i)) {
+          off = (off << 8) + tbuf[i];
+        }
+      }
+    }
+    u32 pos;
+    if (off == 0) {
+      if (!zeroPos) zeroPos = ++count;
+      pos = zeroPos;
+    } else {
+      u32 c = ((off * 2654435761u) >> 8) % tableSize;
+      while (table[2 * c] != 0 && table[2 * c] != off) {
+        if (++c == tableSize) c = 0;
+      }
+      if (table[2 * c] == 0) {
+        if (count >= tableSize / 2) {
+          // Give up counting, the input is far too large for the stub anyway.
+          if (distinct) *distinct = count;
+          return ~0ull >> 1;
+        }
+        table[2 * c] = off;
+        table[2 * c + 1] = ++count;
+      }
+      pos = table[2 * c + 1];
+    }
+    steps += pos;
+    if (format == MODEL_BYTE) {
+      PushBit(tbuf, (in[j >> 3] >> 7) & 1, false);
+    }
+  }
+  if (distinct) *distinct = count;
+  return steps;
+}
+
+// Slots are {context, occupied, pad, counters...}, so that a zero context can
+// be told apart from an empty slot.
+#define STREAM_BIT_SLOT_SIZE 8
+#define STREAM_BYTE_SLOT_SIZE (6 + 2 * 255)
+
+StreamModel::StreamModel(const CompressionParameters& params, u32 tableSize) : tableSize_(tableSize) {
+  Reset(params);
+}
+
+void StreamModel::Reset(const CompressionParameters& params) {
+  params_ = params;
+  slotSize_ = params.format == MODEL_BYTE ? STREAM_BYTE_SLOT_SIZE : STREAM_BIT_SLOT_SIZE;
+  slotCount_ = tableSize_ / slotSize_;
+  size_t size = (size_t)slotCount_ * slotSize_ * params.contextCount;
+  if (size > capacity_) {
+    delete[] tables_;
+    tables_ = new u8[size];
+    capacity_ = size;
+  }
+  memset(tables_, 0, size);
+  memset(tbuf_, 0, sizeof(tbuf_));
+  tbuf_[0] = 1;
+  bit_ = 0;
+  for (int m = 0; m < params_.contextCount; ++m) {
+    used_[m] = 0;
+    FindSlot(m);
+  }
+}
+
+StreamModel::~StreamModel() {
+  delete[] tables_;
+}
+
+void StreamModel::FindSlot(int m) {
+  u8* table = &tables_[(size_t)slotCount_ * slotSize_ * m];
+  if (used_[m] >= slotCount_ / 4 * 3) {
+    memset(table, 0, (size_t)slotCount_ * slotSize_);
+    used_[m] = 0;
+  }
+  u32 off = 0;
+  if (IsStride(params_.contexts[m])) {
+    off = tbuf_[0] << 8 | tbuf_[params_.contexts[m] >> 1];
+  } else {
+    for (int i = 0; i < 8; ++i) {
+      if (params_.contexts[m] & (1 << i)) {
+        off = (off << 8) + tbuf_[i];
+      }
+    }
+  }
+  u32 c = (u32)((off * 2654435761u) * (u64)slotCount_ >> 32);
+  u8* slot = &table[(size_t)c * slotSize_];
+  while (slot[4] && *(u32*)slot != off) {
+    if (++c == slotCount_) c = 0;
+    slot = &table[(size_t)c * slotSize_];
+  }
+  if (!slot[4]) {
+    *(u32*)slot = off;
+    slot[4] = 1;
+    ++used_[m];
+  }
+  cp_[m] = slot;
+}
+
+void StreamModel::Predict(u32* n0, u32* n1) {
+  u32 c0 = 1, c1 = 1;
+  u32 pair = params_.format == MODEL_BYTE ? 4 + 2 * tbuf_[0] : 6;
+  for (int m = 0; m < params_.contextCount; ++m) {
+    c0 += cp_[m][pair] * params_.weights[m];
+    c1 += cp_[m][pair + 1] * params_.weights[m];
+  }
+  *n0 = c0;
+  *n1 = c1;
+}
+
+void StreamModel::Update(int y) {
+  u32 pair = params_.format == MODEL_BYTE ? 4 + 2 * tbuf_[0] : 6;
+  for (int m = 0; m < params_.contextCount; ++m) {
+    u8* cp = &cp_[m][pair];
+    if (cp[y] < 255)
+      ++cp[y];
+    if (cp[1 - y] > 2)
+      cp[1 - y] = cp[1 - y] / 2 + 1;
+  }
+  tbuf_[0] += tbuf_[0] + y;
+  if (++bit_ == 8) {  // Start new byte
+    memmove(&tbuf_[1], &tbuf_[0], sizeof(tbuf_) - 1);
+    tbuf_[0] = 1;
+    bit_ = 0;
+  }
+  if (params_.format != MODEL_BYTE || bit_ == 0) {
+    for (int m = 0; m < params_.contextCount; ++m) {
+      FindSlot(m);
+    }
+  }
+}
+
+StreamEncoder::StreamEncoder(const CompressionParameters& params, WriteFn write, void* ctx)
+    : model_(params), write_(write), ctx_(ctx) {
+}
+
+void StreamEncoder::Reset(const CompressionParameters& params, WriteFn write, void* ctx) {
+  model_.Reset(params);
+  x1_ = 0;
+  x2_ = 0xffffffff;
+  write_ = write;
+  ctx_ = ctx;
+  bufferLen_ = 0;
+}
+
+bool StreamEncoder::Encode(const void* in, int inLen) {
+  const u8* archive = (const u8*)in;
+  for (int j = 0; j < inLen; ++j) {
+    u32 byte = *archive++;
+    for (u32 i = 0; i < 8; ++i) {
+      u32 n0, n1;
+      model_.Predict(&n0, &n1);
+      u32 xmid = RangeSplit(x1_, x2_, n0, n1);
+      int y = (byte >> 7) & 1;
+      if (y) {
+        x1_ = xmid + 1;
+      } else {
+        x2_ = xmid;
+      }
+      model_.Update(y);
+      while (((x1_ ^ x2_) & 0xff000000) == 0) {
+        if (!Put(x2_ >> 24)) return false;
+        x1_ <<= 8;
+        x2_ = (x2_ << 8) + 255;
+      }
+      byte <<= 1;
+    }
+  }
+  return true;
+}
+
+bool StreamEncoder::Finish() {
+  // The decoder pads the stream with zeroes, so the first unequal byte of
+  // x2 is enough to land between x1 and x2.
+  return Put(x2_ >> 24) && Flush();
+}
+
+bool StreamEncoder::Put(u8 b) {
+  if (bufferLen_ == sizeof(buffer_) && !Flush()) return false;
+  buffer_[bufferLen_++] = b;
+  return true;
+}
+
+bool StreamEncoder::Flush() {
+  if (bufferLen_ && !write_(ctx_, buffer_, bufferLen_)) return false;
+  bufferLen_ = 0;
+  return true;
+}
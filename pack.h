@@ -17,15 +17,137 @@
 #ifndef INCLUDED_PACK_H
 #define INCLUDED_PACK_H
 
+#include <string.h>
+
+#include <atomic>
+
 #define MAX_CONTEXT_COUNT 16
 #define MAX_CONTEXT_SIZE (4 << 20)
 
+// Model formats. MODEL_BIT looks up a new context slot for every bit, with
+// the partial byte as part of the key. MODEL_BYTE looks up one slot per byte,
+// holding a bit tree of 255 counter pairs indexed by the partial byte.
+#define MODEL_BIT 1
+#define MODEL_BYTE 2
+
+// MODEL_MIX finds slots as MODEL_BIT does, but a slot holds a 12-bit
+// probability and a 4-bit count instead of two counters. The probabilities of all contexts are
+// mixed in the logistic domain, with weights that adapt as it goes, so only the
+// masks need searching. The weight of each context is its initial weight.
+#define MODEL_MIX 3
+
+// Size of a MODEL_BYTE slot: 4 byte context followed by 255 counter pairs.
+#define BYTE_SLOT_SIZE (4 + 2 * 255)
+
+// Context masks select the partial byte with bit 0 and the bytes 1 to 7 back
+// with bits 1 to 7. Masks with bit 0 clear are stride contexts instead: the
+// partial byte and the byte mask / 2 back, for records and tables longer than
+// 7 bytes. The header stubs find up to MAX_STRIDE zero bytes before the output.
+#define MAX_STRIDE 63
+
 typedef unsigned char u8;
 typedef unsigned short u16;
 typedef unsigned int u32;
 typedef unsigned long long u64;
+typedef long long s64;
+
+// Reciprocals of the 256 mantissa buckets in [1, 2), filled in by pack.cpp.
+extern double reciprocalTable[256];
+
+//! Splits the range [x1, x2] in the ratio n0 : n1.
+/*! Computes x1 + n0 * (u64)(x2 - x1) / (n0 + n1) without a divide, bit for
+    bit identical to the div ebx in the header stubs. The reciprocal of
+    d = n0 + n1 is looked up from the top 8 mantissa bits (relative error
+    below 2^-9) and refined by two Newton steps (error below 2^-36, checked
+    exhaustively for every d < 2^21, which covers 16 contexts with weights
+    and counters up to 255). The quotient estimate is then off by at most
+    one, and the remainder check below makes the result exact.
+*/
+inline u32 RangeSplit(u32 x1, u32 x2, u32 n0, u32 n1) {
+  u32 d = n0 + n1;
+  u64 n = n0 * (u64)(x2 - x1);
+  double dd = d;
+  u64 db, rb;
+  memcpy(&db, &dd, 8);
+  memcpy(&rb, &reciprocalTable[(db >> 44) & 0xff], 8);
+  rb -= (db & 0x7ff0000000000000ull) - 0x3ff0000000000000ull;  // Scale by 2^-exponent.
+  double r;
+  memcpy(&r, &rb, 8);
+  r *= 2.0 - dd * r;
+  r *= 2.0 - dd * r;
+  u64 q = (u64)((double)(s64)n * r);
+  s64 rem = (s64)(n - q * d);
+  while (rem < 0) {
+    --q;
+    rem += d;
+  }
+  while (rem >= (s64)d) {
+    ++q;
+    rem -= d;
+  }
+  return x1 + (u32)q;
+}
+
+inline bool IsStride(u8 mask) { return !(mask & 1); }
+
+//! Key of stride context mask at pos of data, partial being the bits of
+//! data[pos] seen so far behind a leading 1. Bytes before data count as 0.
+inline u32 StrideKey(u8 mask, u32 partial, const u8* data, int pos) {
+  int d = mask >> 1;
+  return partial << 8 | (pos >= d ? data[pos - d] : 0);
+}
+
+//! Tables of the MODEL_MIX mixer, filled in by pack.cpp.
+/*! Probabilities are in 1/4096, stretched probabilities in 1/256. squash
+    starts at 1/2 and follows dp/dx = p (1 - p) in integer steps of 1/256,
+    which the header stubs repeat to build the same tables.
+*/
+struct MixTables {
+  u16 squash[4095];  // Of x - 2047.
+  short stretch[4096];  // Inverse of squash.
+};
+extern MixTables mixTables;
+
+//! Mixes the stretched probabilities of count contexts with weights w.
+/*! \param cp The state of each context: probability << 4 | count, xor 0x8000 so that 0 is 1/2.
+    \param st Filled out with the stretched probabilities, for MixUpdate.
+    \return The probability of a 1 bit, in 1/4096.
+*/
+inline int MixPredict(int count, u8* const* cp, const int* w, int* st) {
+  u32 dot = 0;
+  for (int m = 0; m < count; ++m) {
+    st[m] = mixTables.stretch[(*(u16*)cp[m] ^ 0x8000) >> 4];
+    dot += (u32)(((s64)st[m] * w[m]) >> 16);
+  }
+  int x = (int)(dot + 2047);
+  if (x > 4094) x = 4094;
+  if (x < 0) x = 0;
+  return mixTables.squash[x];
+}
+
+//! Moves the weights and the probability of each context towards bit y.
+/*! A probability moves by 1/2 of the error on the first bit seen in its
+    slot, then by 1/4, 1/8 and from then on 1/16.
+*/
+inline void MixUpdate(int count, u8* const* cp, int* w, const int* st, int y, int p1) {
+  int err = (y << 12) - p1;
+  for (int m = 0; m < count; ++m) {
+    w[m] += (st[m] * err) >> 10;
+    int s = *(u16*)cp[m] ^ 0x8000;
+    int p = s >> 4, n = s & 15;
+    p += ((y << 12) - p) >> (n + 1);
+    if (n < 3) ++n;
+    *(u16*)cp[m] = (p << 4 | n) ^ 0x8000;
+  }
+}
+
+//! Splits the range [x1, x2] for a probability p1 of a 1 bit, in 1/4096.
+inline u32 MixSplit(u32 x1, u32 x2, int p1) {
+  return x1 + (u32)((u64)(x2 - x1) * (4096 - p1) >> 12);
+}
 
 struct CompressionParameters {
+  int format = MODEL_BIT;
   int contextCount = 0;
   u8 weights[MAX_CONTEXT_COUNT];
   u8 contexts[MAX_CONTEXT_COUNT];
@@ -34,10 +156,76 @@ struct CompressionParameters {
   void ToString(char* str);
 };
 
+//! A stretch of the data compressed with its own parameters.
+/*! The model state carries over from one segment to the next, only the
+    weights and context masks change. All segments of a stream use the same
+    format and number of contexts, and the first one starts at 0.
+*/
+struct Segment {
+  int start = 0;  // Offset of the first byte of the segment.
+  CompressionParameters params;
+};
+
+//! Called by Compressor::Search after every iteration, with the fitness
+//! (compressed size plus costs) of the best parameters so far.
+typedef void (*ProgressFn)(void* ctx, int iteration, int iterations, int best);
+
+class Compressor;
+
+//! Single context masks, best first, as ranked by the pre-scan of Compressor::Search.
+struct PatternRanking {
+  int count = 0;
+  u8 masks[128];
+};
+
+//! Context masks and weights that won on earlier inputs, most used first.
+/*! Mined from a corpus by the prior tool, for Compressor::SetPrior. Saved as
+    text: a line "elfling-prior <format> <inputs> <contexts>", then a line
+    "<mask> <hits> <weight>" per mask, the mask in hex.
+*/
+struct ContextPrior {
+  int format = MODEL_BIT;
+  int inputs = 0;  // Parameter sets the prior was mined from.
+  int contextCount = 0;  // Their average number of contexts.
+  int count = 0;  // Masks used by any of them.
+  u8 masks[255];
+  u16 hits[255];  // Parameter sets that use the mask.
+  u8 weights[255];  // Average weight of the mask in those.
+
+  //! Adds the best parameters found for one input.
+  void Add(const CompressionParameters& params);
+  bool Load(const char* path);
+  bool Save(const char* path) const;
+};
+
+//! What each context of a parameter set contributes, from Compressor::Contributions.
+/*! Sizes are in bytes, estimated from the probabilities the model codes
+    with, so they leave out the few bytes the coder adds.
+*/
+struct ContextReport {
+  double size = 0;  // Of the data with all contexts.
+  double dropped[MAX_CONTEXT_COUNT];  // Size change without the context, positive if it helps.
+  int weightStep[MAX_CONTEXT_COUNT];  // How far lower and higher move the weight, 0 for MODEL_MIX.
+  double lower[MAX_CONTEXT_COUNT];  // Size change with the weight weightStep lower.
+  double higher[MAX_CONTEXT_COUNT];  // Size change with the weight weightStep higher.
+};
+
+struct ContributionStats;
+struct Screening;
+
+//! Runs work(arg, i, compressor) for all i in [0, count), possibly on several
+//! threads. Every call gets a Compressor that no other call uses at the same time.
+typedef void (*TrialFn)(void* arg, int i, Compressor* compressor);
+typedef void (*ParallelFn)(void* ctx, int count, TrialFn work, void* arg);
+
 class Compressor {
 public:
+  ~Compressor();
+
   //! Compresses data.
-  /*! \param params Filled out with the compression parameters.
+  /*! Searches for parameters, then steps from the best ones found to
+      neighbouring weights and masks as long as that makes the data smaller.
+      \param params Filled out with the compression parameters.
       \param in Pointer to input data.
       \param inLen Length of input data in bytes.
       \param out Pointer to output data.
@@ -49,17 +237,255 @@ public:
   //! Decompresses data.
   /*! \param params Compression parameters.
       \param in Pointer to last 4 bytes of input data, since this is read backwards.
-      \param out Pointer to output data.
+      \param out Pointer to output data. Exactly outLen bytes are written.
       \param outLen Length of output data.
   */
   void Decompress(CompressionParameters* params, void* in, void* out, int outLen);
-  
+
+  //! Compresses data with the given parameters, without searching for better ones.
+  /*! \param params Compression parameters.
+      \param in Pointer to input data.
+      \param inLen Length of input data in bytes.
+      \param out Pointer to output data.
+      \param outLen Pointer to length of output data. Must contain maximum length of output data as input.
+      \return true if the data could be compressed into the provided output buffer.
+  */
+  bool CompressSingle(CompressionParameters* params, void* in, int inLen, void* out, int* outLen);
+
+  //! Compresses data with different parameters for each segment of it.
+  /*! \param segments The segments, in order of their start.
+      \param count Number of segments.
+      The other parameters are those of CompressSingle.
+  */
+  bool CompressSegments(const Segment* segments, int count, void* in, int inLen, void* out, int* outLen);
+
+  //! Decompresses data compressed with CompressSegments.
+  void DecompressSegments(const Segment* segments, int count, void* in, void* out, int outLen);
+
+  //! Searches for the compression parameters that suit data best.
+  /*! Compress is Optimize followed by CompressSingle. Several threads may search
+      at once, each with its own Compressor; call SetQuiet to keep them from
+      printing.
+      \param params Filled out with the best parameters found. If it holds
+             parameters on input, the search starts with them.
+      \param in Pointer to input data.
+      \param inLen Length of input data in bytes.
+      \param progress If not null, called after every iteration.
+      \param ctx Passed to progress.
+      \param cancel If not null, the search stops after the iteration during which it becomes true.
+      \return false if the search was cancelled, params then hold the best parameters so far.
+  */
+  bool Search(CompressionParameters* params, const void* in, int inLen, ProgressFn progress, void* ctx,
+              const std::atomic<bool>* cancel);
+
+  //! Searches for parameters as Search does, then refines them and, with SetPrune, prunes them.
+  /*! This is how Compress finds its parameters; the parameters are those of Search. */
+  bool Optimize(CompressionParameters* params, const void* in, int inLen, ProgressFn progress, void* ctx,
+                const std::atomic<bool>* cancel);
+
+  //! Returns the compressed size of data with the given parameters.
+  /*! The output goes to a buffer of the Compressor. Sizes over 2 * inLen + 1024
+      mean the data could not be compressed.
+  */
+  int TrialSize(CompressionParameters* params, const void* in, int inLen);
+
+  //! Measures what each context contributes to the compressed size of data.
+  /*! Takes a single pass over the data: the counters of a context do not
+      depend on the other contexts, so the cost of every bit without a
+      context, or with its weight changed, follows from the counters the
+      pass sees. With MODEL_MIX the mixer weights do depend on each other,
+      and dropping a context is estimated with the weights the others learned.
+  */
+  void Contributions(CompressionParameters* params, const void* in, int inLen, ContextReport* report);
+
+  //! Has Compress drop contexts that do not pay for themselves.
+  /*! A context must save more than its two bytes of parameters plus its
+      share of the startup cost, as weighed by SetStartupWeight.
+  */
+  void SetPrune(bool prune) { prune_ = prune; }
+
+  //! Lets Search spread its trial compressions over several threads.
+  /*! By default they all run on the calling thread, with this Compressor. */
+  void SetParallel(ParallelFn parallel, void* ctx) {
+    parallel_ = parallel;
+    parallelCtx_ = ctx;
+  }
+
+  //! Lets Search reuse the pre-scan of an earlier search on similar data.
+  /*! If ranking holds masks, Search starts from them instead of testing every
+      mask again, otherwise it stores the masks it ranks there.
+  */
+  void SetPatternRanking(PatternRanking* ranking) { ranking_ = ranking; }
+
+  //! Lets Search draw the masks and weights of its first population from a prior.
+  /*! Only used if the prior is for the format searched. Most masks are drawn
+      by how often they won before, the rest from the pre-scan, so masks the
+      prior has not seen still get a chance.
+  */
+  void SetPrior(const ContextPrior* prior) { prior_ = prior; }
+
+  //! Lets Search try stride contexts, which reach up to MAX_STRIDE bytes back.
+  /*! Only the headers built with STRIDES can decompress them. */
+  void SetStrides(bool strides) { strides_ = strides; }
+
+  //! Estimates the startup work of the header stub for a parameter set.
+  /*! The stub finds context slots by scanning each table linearly from the
+      start, so this counts the slots those scans step through while
+      decompressing the data, summed over all contexts.
+      \param params Compression parameters.
+      \param in Pointer to input data.
+      \param inLen Length of input data in bytes.
+      \param distinct If not null, filled out with the number of distinct contexts per table.
+      \return The number of probe steps.
+  */
+  u64 ProbeSteps(CompressionParameters* params, void* in, int inLen, u32* distinct = nullptr);
+
+  //! Sets how many bytes of output one million probe steps are worth to Compress.
+  /*! With a weight of 0 (the default), only the compressed size counts. */
+  void SetStartupWeight(double weight) { startupWeight_ = weight; }
+
+  //! Stops Compress from printing its progress, for use from several threads.
+  void SetQuiet(bool quiet) { quiet_ = quiet; }
+
+  //! Sets a function for Compress to report the progress of its search to.
+  void SetProgress(ProgressFn progress, void* ctx) {
+    progress_ = progress;
+    progressCtx_ = ctx;
+  }
+
 private:
-  bool CompressSingle(CompressionParameters* comp, void* in, int inLen, void* out, int* outLen);
+  bool CompressSegmentsByte(const Segment* segments, int count, void* in, int inLen, void* out, int* outLen);
+  void DecompressSegmentsByte(const Segment* segments, int count, void* in, void* out, int outLen);
+  u8* ClearByteSlots();
+  u64 MaskSteps(int format, u8 mask, void* in, int inLen);
+  u64 MaskProbeSteps(int format, u8 mask, u8* in, int inLen, u32* distinct);
+  void Trials(CompressionParameters** params, int** sizes, int count, const void* in, int inLen);
+  void Screen(int format, const u8* in, int inLen, Screening* screen);
+  void CounterHistory(int format, u8 mask, const u8* in, int inLen, u8* history);
+  void Refine(CompressionParameters* params, void* in, int inLen);
+  void Prune(CompressionParameters* params, void* in, int inLen);
 
 private:
   unsigned char modelCounters_[MAX_CONTEXT_SIZE * MAX_CONTEXT_COUNT];
+  // Offsets of the MODEL_BYTE slots in use, so they can be cleared without
+  // touching the rest of modelCounters_.
+  u32 byteSlots_[MAX_CONTEXT_SIZE * MAX_CONTEXT_COUNT / BYTE_SLOT_SIZE];
+  u32 byteSlotCount_ = 0;
+  bool byteSlotsValid_ = false;
+  // ProbeSteps results per context mask for the input seen last.
+  u64 probeSteps_[256];
+  u32 probeContexts_[256];
+  bool probeValid_[256];
+  u64 probeHash_ = 0;  // Of the contents of the input seen last.
+  int probeInputLen_ = 0;
+  int probeFormat_ = 0;
+  double startupWeight_ = 0;
   bool verbose_ = false;
+  bool quiet_ = false;
+  bool prune_ = false;
+  bool strides_ = false;
+  ContributionStats* stats_ = nullptr;  // Filled in by the compression pass of Contributions.
+  int cmax_ = 0;  // Longest probe into the counter tables, for reporting.
+  ProgressFn progress_ = nullptr;
+  void* progressCtx_ = nullptr;
+  PatternRanking* ranking_ = nullptr;
+  const ContextPrior* prior_ = nullptr;
+  ParallelFn parallel_ = nullptr;
+  void* parallelCtx_ = nullptr;
+  u8* scratch_ = nullptr;  // Output of TrialSize.
+  int scratchSize_ = 0;
+};
+
+// Callbacks through which the stream coders write and read compressed data.
+// WriteFn returns false on failure, ReadFn the number of bytes read.
+typedef bool (*WriteFn)(void* ctx, const void* data, int len);
+typedef int (*ReadFn)(void* ctx, void* data, int len);
+
+//! Context model for streams of unbounded size.
+/*! Uses the same counters and contexts as Compressor, but finds slots by
+    hashing on both sides, and clears a context's table when it is three
+    quarters full, so memory stays bounded by tableSize per context.
+*/
+class StreamModel {
+public:
+  StreamModel(const CompressionParameters& params, u32 tableSize = MAX_CONTEXT_SIZE);
+  ~StreamModel();
+
+  //! Starts over with new parameters, keeping the tables if they are large enough.
+  void Reset(const CompressionParameters& params);
+
+  //! Returns the weighted counts for the next bit being 0 or 1.
+  void Predict(u32* n0, u32* n1);
+
+  //! Counts bit y and moves on to the next bit.
+  void Update(int y);
+
+private:
+  void FindSlot(int m);
+
+  CompressionParameters params_;
+  u32 tableSize_;
+  u32 slotSize_;
+  u32 slotCount_;
+  u8* tables_ = nullptr;
+  size_t capacity_ = 0;  // Bytes allocated for tables_.
+  u32 used_[MAX_CONTEXT_COUNT];  // Slots in use per table.
+  u8* cp_[MAX_CONTEXT_COUNT];  // Current counters, the slot for MODEL_BYTE.
+  u8 tbuf_[MAX_STRIDE + 1];  // The partial byte, then the bytes before it.
+  int bit_;
+};
+
+//! Compresses a stream in pieces of any size.
+/*! The output is written forwards, in pieces of up to 4 KB, through write. */
+class StreamEncoder {
+public:
+  StreamEncoder(const CompressionParameters& params, WriteFn write, void* ctx);
+
+  //! Starts a new stream, reusing the model memory. Call Finish first to complete the last one.
+  void Reset(const CompressionParameters& params, WriteFn write, void* ctx);
+
+  //! Compresses inLen more bytes. Returns false if writing failed.
+  bool Encode(const void* in, int inLen);
+
+  //! Flushes the remaining output. Returns false if writing failed.
+  bool Finish();
+
+private:
+  bool Put(u8 b);
+  bool Flush();
+
+  StreamModel model_;
+  u32 x1_ = 0;
+  u32 x2_ = 0xffffffff;
+  WriteFn write_;
+  void* ctx_;
+  u8 buffer_[4096];
+  int bufferLen_ = 0;
+};
+
+//! Decompresses a stream written by StreamEncoder, in pieces of any size.
+class StreamDecoder {
+public:
+  StreamDecoder(const CompressionParameters& params, ReadFn read, void* ctx);
+
+  //! Starts reading a new stream, reusing the model memory.
+  void Reset(const CompressionParameters& params, ReadFn read, void* ctx);
+
+  //! Decompresses the next outLen bytes.
+  void Decode(void* out, int outLen);
+
+private:
+  u8 Get();
+
+  StreamModel model_;
+  u32 x1_ = 0;
+  u32 x2_ = 0xffffffff;
+  u32 x_ = 0;  // The next 4 bytes of compressed data.
+  ReadFn read_;
+  void* ctx_;
+  u8 buffer_[4096];
+  int bufferPos_ = 0;
+  int bufferLen_ = 0;
 };
 
 #endif  // INCLUDED_PACK_H
@@ -14,14 +14,20 @@
 //
 // elfling - a linking compressor for ELF files by Minas ^ Calodox
 
+#define _FILE_OFFSET_BITS 64
+
 #include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+#include <atomic>
+#include <string>
+#include <thread>
 #include <vector>
 
+#include "daemon.h"
 #include "pack.h"
 
 typedef unsigned char u8;
@@ -30,69 +36,418 @@ typedef unsigned int u32;
 typedef unsigned long long u64;
 typedef unsigned int u24;
 
-void Invert(u8* data, u32 s) {
-  for (u32 i = 0; i < s >> 1; ++i) {
-    u8 t = data[i];
-    data[i] = data[s - i - 1];
-    data[s - i - 1] = t;
+// Version 2 .pack files start with this, followed by the version byte, the
+// model format, the 64-bit size and the compression parameters. The
+// compressed data follows, stored forwards. Version 1 files have no magic and
+// start with the 32-bit size.
+const char* packMagic = "ELFP";
+#define PACK_VERSION 2
+
+// Version 3 .pack files are split into blocks that are modeled independently,
+// so they can be packed and unpacked on several threads. The header is
+// followed by the 32-bit block size, the block count and an index with one
+// entry per block, so any block can be unpacked on its own.
+#define PACK_VERSION_BLOCKS 3
+
+// Each worker holds a Compressor of 64 MB and its blocks, which would run a
+// 32-bit packer out of address space on a machine with many cores.
+#define MAX_THREADS 8
+#define INDEX_ENTRY_SIZE (8 + 4 + 2 + 2 * MAX_CONTEXT_COUNT)
+
+// Input is read and written in chunks of this size.
+#define CHUNK_SIZE (1 << 20)
+
+// Parameters are searched on at most this many bytes from the start of the
+// input.
+#define SAMPLE_SIZE (64 << 10)
+
+struct Block {
+  u64 offset = 0;  // Of the compressed data in the .pack file.
+  u32 packedSize = 0;
+  CompressionParameters params;
+  std::vector<u8> data;  // Uncompressed or compressed, depending on the stage.
+};
+
+static bool WriteFile(void* ctx, const void* data, int len) {
+  return fwrite(data, 1, len, (FILE*)ctx) == (size_t)len;
+}
+
+static int ReadFile(void* ctx, void* data, int len) {
+  return fread(data, 1, len, (FILE*)ctx);
+}
+
+static bool WriteVector(void* ctx, const void* data, int len) {
+  std::vector<u8>* v = (std::vector<u8>*)ctx;
+  v->insert(v->end(), (const u8*)data, (const u8*)data + len);
+  return true;
+}
+
+struct MemoryReader {
+  const u8* data;
+  int left;
+};
+
+static int ReadMemory(void* ctx, void* data, int len) {
+  MemoryReader* r = (MemoryReader*)ctx;
+  if (len > r->left) len = r->left;
+  memcpy(data, r->data, len);
+  r->data += len;
+  r->left -= len;
+  return len;
+}
+
+// Runs work(i) for i in [0, count) on up to threadCount threads.
+template<typename F> void ParallelFor(int count, int threadCount, F work) {
+  std::atomic<int> next(0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < threadCount && t < count; ++t) {
+    threads.push_back(std::thread([&]() {
+      for (int i = next++; i < count; i = next++) {
+        work(i);
+      }
+    }));
+  }
+  for (size_t t = 0; t < threads.size(); ++t) {
+    threads[t].join();
   }
 }
 
-int main(int argc, char*argv[]) {
-  if (argc < 2) { return 1; }
-  bool unpack = strstr(argv[1], ".pack") != nullptr;
-  FILE* fptr = fopen(argv[1], "rb");
-  if (!fptr) { printf("Could not open %s\n", argv[1]); return 1; }
-  fseek(fptr, 0, SEEK_END);
-  u32 size = ftell(fptr);
-  fseek(fptr, 0, SEEK_SET);
+void WriteIndexEntry(const Block& b, FILE* ofptr) {
+  u8 entry[INDEX_ENTRY_SIZE];
+  memset(entry, 0, sizeof(entry));
+  memcpy(&entry[0], &b.offset, 8);
+  memcpy(&entry[8], &b.packedSize, 4);
+  entry[12] = b.params.format;
+  entry[13] = b.params.contextCount;
+  memcpy(&entry[14], b.params.weights, b.params.contextCount);
+  memcpy(&entry[14 + MAX_CONTEXT_COUNT], b.params.contexts, b.params.contextCount);
+  fwrite(entry, sizeof(entry), 1, ofptr);
+}
+
+bool ReadIndexEntry(Block* b, FILE* fptr) {
+  u8 entry[INDEX_ENTRY_SIZE];
+  if (fread(entry, sizeof(entry), 1, fptr) != 1) return false;
+  memcpy(&b->offset, &entry[0], 8);
+  memcpy(&b->packedSize, &entry[8], 4);
+  b->params.format = entry[12];
+  b->params.contextCount = entry[13];
+  memcpy(b->params.weights, &entry[14], MAX_CONTEXT_COUNT);
+  memcpy(b->params.contexts, &entry[14 + MAX_CONTEXT_COUNT], MAX_CONTEXT_COUNT);
+  return b->params.contextCount >= 1 && b->params.contextCount <= MAX_CONTEXT_COUNT;
+}
+
+// Searches parameters for inLen bytes of in, with the daemon listening on
+// daemon if it is given and can be reached, under key.
+void SearchParams(CompressionParameters* params, u8* in, int inLen, const char* daemon, const std::string& key,
+                  bool quiet) {
+  int os = 2 * inLen + 64;
+  std::vector<u8> out(os);
+  if (daemon && DaemonCompress(daemon, key.c_str(), DaemonOptions(), params, in, inLen, &out[0], &os)) return;
+  if (daemon) printf("Could not reach the daemon at %s, searching here\n", daemon);
+  Compressor* comp = new Compressor();
+  comp->SetQuiet(quiet);
+  comp->Compress(params, in, inLen, &out[0], &os);
+  delete comp;
+}
+
+// Finds the parameters for b, unless they were given, and compresses it.
+void PackBlock(Block* b, const char* paramString, const char* daemon, const std::string& key) {
+  b->params.format = MODEL_BYTE;
+  if (!paramString || !b->params.FromString(paramString)) {
+    int sample = b->data.size() < SAMPLE_SIZE ? b->data.size() : SAMPLE_SIZE;
+    std::vector<u8> in(sample + 10, 0);  // A few zero bytes before the input, as in Pack.
+    memcpy(&in[10], &b->data[0], sample);
+    SearchParams(&b->params, &in[10], sample, daemon, key, true);
+  }
+  std::vector<u8> packed;
+  StreamEncoder* enc = new StreamEncoder(b->params, WriteVector, &packed);
+  enc->Encode(&b->data[0], b->data.size());
+  enc->Finish();
+  delete enc;
+  b->packedSize = packed.size();
+  b->data.swap(packed);
+}
+
+void UnpackBlock(Block* b, u32 size) {
+  MemoryReader r = { &b->data[0], (int)b->data.size() };
+  StreamDecoder* dec = new StreamDecoder(b->params, ReadMemory, &r);
+  std::vector<u8> out(size);
+  dec->Decode(&out[0], size);
+  delete dec;
+  b->data.swap(out);
+}
+
+// Packs blockSize bytes per block, threadCount blocks at a time. With
+// measureLoss, also packs the whole input as one stream with the parameters
+// of the first block, to report what the block boundaries cost.
+int PackBlocks(FILE* fptr, FILE* ofptr, const char* paramString, u32 blockSize, int threadCount, bool measureLoss,
+               const char* daemon, const char* fn) {
+  fseeko(fptr, 0, SEEK_END);
+  u64 size = ftello(fptr);
+  fseeko(fptr, 0, SEEK_SET);
+  u32 blockCount = (u32)((size + blockSize - 1) / blockSize);
+
+  u8 version = PACK_VERSION_BLOCKS;
+  fwrite(packMagic, 4, 1, ofptr);
+  fwrite(&version, 1, 1, ofptr);
+  fwrite(&size, 8, 1, ofptr);
+  fwrite(&blockSize, 4, 1, ofptr);
+  fwrite(&blockCount, 4, 1, ofptr);
+  u64 indexOffset = ftello(ofptr);
+  std::vector<Block> index(blockCount);
+  for (u32 i = 0; i < blockCount; ++i) {
+    WriteIndexEntry(index[i], ofptr);  // Filled in at the end.
+  }
+
+  time_t start = time(nullptr);
+  std::vector<Block> batch(threadCount);
+  for (u32 first = 0; first < blockCount; first += threadCount) {
+    int count = blockCount - first < (u32)threadCount ? blockCount - first : threadCount;
+    for (int i = 0; i < count; ++i) {
+      u64 l = size - (u64)(first + i) * blockSize;
+      batch[i].data.resize(l < blockSize ? l : blockSize);
+      fread(&batch[i].data[0], 1, batch[i].data.size(), fptr);
+    }
+    ParallelFor(count, threadCount, [&](int i) {
+      PackBlock(&batch[i], paramString, daemon, std::string(fn) + ":" + std::to_string(first + i));
+    });
+    for (int i = 0; i < count; ++i) {
+      Block& b = index[first + i];
+      b.offset = ftello(ofptr);
+      b.packedSize = batch[i].packedSize;
+      b.params = batch[i].params;
+      if (fwrite(&batch[i].data[0], 1, b.packedSize, ofptr) != b.packedSize) { printf("Write failed\n"); return 1; }
+      char buf[128];
+      b.params.ToString(buf);
+      printf("Block %u: %u bytes, %s\n", first + i, b.packedSize, buf);
+    }
+  }
+  u64 packedSize = ftello(ofptr);
+  fseeko(ofptr, indexOffset, SEEK_SET);
+  for (u32 i = 0; i < blockCount; ++i) {
+    WriteIndexEntry(index[i], ofptr);
+  }
+  printf("Packed %llu bytes into %llu in %u blocks, %d threads, %d s\n", size, packedSize,
+         blockCount, threadCount, (int)(time(nullptr) - start));
+  printf("Header and index: %llu bytes\n", indexOffset + (u64)blockCount * INDEX_ENTRY_SIZE);
+
+  if (measureLoss && blockCount) {
+    std::vector<u8> packed;
+    StreamEncoder* enc = new StreamEncoder(index[0].params, WriteVector, &packed);
+    std::vector<u8> data(blockSize);
+    fseeko(fptr, 0, SEEK_SET);
+    for (int l = fread(&data[0], 1, blockSize, fptr); l > 0; l = fread(&data[0], 1, blockSize, fptr)) {
+      enc->Encode(&data[0], l);
+    }
+    enc->Finish();
+    delete enc;
+    printf("Single stream: %llu bytes, block boundaries cost %lld bytes\n", (u64)packed.size(),
+           (long long)(packedSize - packed.size() - (indexOffset + (u64)blockCount * INDEX_ENTRY_SIZE)));
+  }
+  return 0;
+}
+
+// Unpacks all blocks, or only block extract if it is not negative.
+int UnpackBlocks(FILE* fptr, FILE* ofptr, int threadCount, int extract) {
+  u64 size = 0;
+  u32 blockSize = 0, blockCount = 0;
+  fread(&size, 8, 1, fptr);
+  fread(&blockSize, 4, 1, fptr);
+  fread(&blockCount, 4, 1, fptr);
+  std::vector<Block> index(blockCount);
+  for (u32 i = 0; i < blockCount; ++i) {
+    if (!ReadIndexEntry(&index[i], fptr)) { printf("Invalid index entry %u\n", i); return 1; }
+  }
+  u32 first = 0, last = blockCount;
+  if (extract >= 0) {
+    if ((u32)extract >= blockCount) { printf("No block %d, there are %u\n", extract, blockCount); return 1; }
+    first = extract;
+    last = extract + 1;
+  }
+
+  std::vector<Block*> batch(threadCount);
+  for (; first < last; first += threadCount) {
+    int count = last - first < (u32)threadCount ? last - first : threadCount;
+    for (int i = 0; i < count; ++i) {
+      Block* b = batch[i] = &index[first + i];
+      b->data.resize(b->packedSize);
+      fseeko(fptr, b->offset, SEEK_SET);
+      if (fread(&b->data[0], 1, b->packedSize, fptr) != b->packedSize) { printf("Block %u is truncated\n", first + i); return 1; }
+    }
+    ParallelFor(count, threadCount, [&](int i) {
+      u64 l = size - (u64)(first + i) * blockSize;
+      UnpackBlock(batch[i], l < blockSize ? l : blockSize);
+    });
+    for (int i = 0; i < count; ++i) {
+      if (fwrite(&batch[i]->data[0], 1, batch[i]->data.size(), ofptr) != batch[i]->data.size()) { printf("Write failed\n"); return 1; }
+      std::vector<u8>().swap(batch[i]->data);
+    }
+  }
+  return 0;
+}
+
+// Unpacks a version 1 file, which has to fit in memory.
+int UnpackV1(FILE* fptr, u64 size, FILE* ofptr) {
   int os = 0;
   CompressionParameters params;
   memset(&params, 0, sizeof(params));
-  if (unpack) {
-    fread(&os, 4, 1, fptr);
-    fread(&params.contextCount, 1, 1, fptr);
-    fread(params.weights, params.contextCount, 1, fptr);
-    fread(params.contexts, params.contextCount, 1, fptr);
-    size -= ftell(fptr);
-  }
+  fread(&os, 4, 1, fptr);
+  fread(&params.contextCount, 1, 1, fptr);
+  fread(params.weights, params.contextCount, 1, fptr);
+  fread(params.contexts, params.contextCount, 1, fptr);
+  size -= ftello(fptr);
   u8* data = (u8*)malloc(size + 10);
   memset(data, 0, size + 10);
   data += 10;  // Ugly, but we can ensure we have a few zero bytes at the beginning of the input.
   fread(data, 1, size, fptr);
-  fclose(fptr);
+
+  u8* out = (u8*)malloc(os + 10);
+  memset(out, 0, os + 10);
+  out += 10;  // Ugly, but we can ensure we have a few zero bytes at the beginning of the output.
+  Compressor* comp = new Compressor();
+  comp->Decompress(&params, &data[size - 4], out, os);
+  fwrite(out, os, 1, ofptr);
+  return 0;
+}
+
+int Unpack(FILE* fptr, FILE* ofptr, int threadCount, int extract) {
+  char magic[4];
+  u8 version = 0;
+  if (fread(magic, 4, 1, fptr) != 1 || memcmp(magic, packMagic, 4) ||
+      fread(&version, 1, 1, fptr) != 1) {
+    fseeko(fptr, 0, SEEK_END);
+    u64 size = ftello(fptr);
+    fseeko(fptr, 0, SEEK_SET);
+    return UnpackV1(fptr, size, ofptr);
+  }
+  if (version == PACK_VERSION_BLOCKS) {
+    return UnpackBlocks(fptr, ofptr, threadCount, extract);
+  }
+  if (version != PACK_VERSION) { printf("Unknown .pack version %d\n", version); return 1; }
+  CompressionParameters params;
+  u8 format = 0, count = 0;
+  u64 size = 0;
+  fread(&format, 1, 1, fptr);
+  fread(&size, 8, 1, fptr);
+  fread(&count, 1, 1, fptr);
+  if (count < 1 || count > MAX_CONTEXT_COUNT) { printf("Invalid context count %d\n", count); return 1; }
+  params.format = format;
+  params.contextCount = count;
+  fread(params.weights, count, 1, fptr);
+  fread(params.contexts, count, 1, fptr);
+
+  StreamDecoder* dec = new StreamDecoder(params, ReadFile, fptr);
+  u8* out = (u8*)malloc(CHUNK_SIZE);
+  for (u64 done = 0; done < size; ) {
+    int l = size - done < CHUNK_SIZE ? (int)(size - done) : CHUNK_SIZE;
+    dec->Decode(out, l);
+    if (fwrite(out, 1, l, ofptr) != (size_t)l) { printf("Write failed\n"); return 1; }
+    done += l;
+  }
+  delete dec;
+  free(out);
+  return 0;
+}
+
+int Pack(FILE* fptr, FILE* ofptr, const char* paramString, const char* daemon, const char* fn) {
+  fseeko(fptr, 0, SEEK_END);
+  u64 size = ftello(fptr);
+  fseeko(fptr, 0, SEEK_SET);
+
+  u8* data = (u8*)malloc(CHUNK_SIZE + 10);
+  memset(data, 0, CHUNK_SIZE + 10);
+  data += 10;  // Ugly, but we can ensure we have a few zero bytes at the beginning of the input.
+  int l = fread(data, 1, CHUNK_SIZE, fptr);
+
+  // Streams use the byte model, it needs far fewer lookups per byte.
+  CompressionParameters params;
+  params.format = MODEL_BYTE;
+  if (!paramString || !params.FromString(paramString)) {
+    // Search the parameters on the first part of the input only.
+    int sample = l < SAMPLE_SIZE ? l : SAMPLE_SIZE;
+    SearchParams(&params, data, sample, daemon, fn, false);
+  }
+
+  u8 format = params.format, count = params.contextCount, version = PACK_VERSION;
+  fwrite(packMagic, 4, 1, ofptr);
+  fwrite(&version, 1, 1, ofptr);
+  fwrite(&format, 1, 1, ofptr);
+  fwrite(&size, 8, 1, ofptr);
+  fwrite(&count, 1, 1, ofptr);
+  fwrite(params.weights, count, 1, ofptr);
+  fwrite(params.contexts, count, 1, ofptr);
+
+  StreamEncoder* enc = new StreamEncoder(params, WriteFile, ofptr);
+  u64 done = 0;
+  while (l > 0) {
+    if (!enc->Encode(data, l)) { printf("Write failed\n"); return 1; }
+    done += l;
+    if (size > CHUNK_SIZE) {
+      printf("\r%llu / %llu bytes", done, size);
+      fflush(stdout);
+    }
+    l = fread(data, 1, CHUNK_SIZE, fptr);
+  }
+  if (!enc->Finish()) { printf("Write failed\n"); return 1; }
+  delete enc;
+  printf("\rPacked %llu bytes into %llu\n", size, (u64)ftello(ofptr));
+  return 0;
+}
+
+int main(int argc, char*argv[]) {
+  const char* fn = nullptr;
+  const char* paramString = nullptr;
+  u32 blockSize = 0;
+  int threadCount = std::thread::hardware_concurrency();
+  int extract = -1;
+  bool measureLoss = false;
+  const char* daemon = nullptr;
+  for (int i = 1; i < argc; ++i) {
+    if (argv[i][0] == '-') {
+      switch (argv[i][1]) {
+        case 'b': blockSize = (argv[i][2] ? atoi(&argv[i][2]) : 1024) << 10; break;
+        case 't': threadCount = atoi(&argv[i][2]); break;
+        case 'x': extract = atoi(&argv[i][2]); break;
+        case 'l': measureLoss = true; break;
+        case 'd': daemon = &argv[i][2]; break;
+      }
+    } else if (!fn) {
+      fn = argv[i];
+    } else {
+      paramString = argv[i];
+    }
+  }
+  if (!fn) {
+    printf("Usage: packer [-b[KB]] [-t<threads>] [-l] [-d<socket>] [file] [params]\n");
+    printf("       packer [-t<threads>] [-x<block>] [file.pack]\n");
+    return 1;
+  }
+  if (threadCount < 1) threadCount = 1;
+  if (threadCount > MAX_THREADS) threadCount = MAX_THREADS;
+  bool unpack = strstr(fn, ".pack") != nullptr;
+  FILE* fptr = fopen(fn, "rb");
+  if (!fptr) { printf("Could not open %s\n", fn); return 1; }
 
   char ofn[256];
-  strcpy(ofn, argv[1]);
+  strcpy(ofn, fn);
   if (unpack) {
     *strrchr(ofn, '.') = 0;
     strcat(ofn, ".unpack");
   } else {
     strcat(ofn, ".pack");
   }
-  
-  u8* out = (u8*)malloc(65536);
-  memset(out, 0, 65536);
-  out += 10;  // Ugly, but we can ensure we have a few zero bytes at the beginning of the output.
   FILE* ofptr = fopen(ofn, "wb");
-  if (!ofptr) { printf("Could not open %s\n", argv[1]); return 1; }
+  if (!ofptr) { printf("Could not open %s\n", ofn); return 1; }
 
+  int rv;
   if (unpack) {
-    Compressor* comp = new Compressor();
-    comp->Decompress(&params, &data[size - 4], out, os);
-    fwrite(out, os, 1, ofptr);
+    rv = Unpack(fptr, ofptr, threadCount, extract);
+  } else if (blockSize) {
+    rv = PackBlocks(fptr, ofptr, paramString, blockSize, threadCount, measureLoss, daemon, fn);
   } else {
-    Compressor* comp = new Compressor();
-    os = 65528;
-    comp->Compress(&params, data, size, out, &os);
-    Invert(out, os);
-
-    fwrite(&size, 4, 1, ofptr);
-    fwrite(&params.contextCount, 1, 1, ofptr);
-    fwrite(params.weights, params.contextCount, 1, ofptr);
-    fwrite(params.contexts, params.contextCount, 1, ofptr);
-    fwrite(out, os, 1, ofptr);
+    rv = Pack(fptr, ofptr, paramString, daemon, fn);
   }
+  fclose(fptr);
   fclose(ofptr);
-  return 0;
+  return rv;
 }
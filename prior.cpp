@@ -0,0 +1,136 @@
+// Copyright 2014 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// elfling - a linking compressor for ELF files by Minas ^ Calodox
+
+// Mines the parameters that won on a corpus of earlier links into a prior,
+// which elfling -fprior=<file> draws its first population from. Inputs are
+// either images to search, such as the test/tmp elfling leaves behind, or
+// text files of parameters found before, one per line: -c strings or the
+// "Params:" lines of elfling's output.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "pack.h"
+
+static bool ReadFile(const char* fn, std::vector<u8>* data) {
+  FILE* fptr = fopen(fn, "rb");
+  if (!fptr) return false;
+  fseek(fptr, 0, SEEK_END);
+  data->resize(ftell(fptr));
+  fseek(fptr, 0, SEEK_SET);
+  bool rv = fread(data->data(), 1, data->size(), fptr) == data->size();
+  fclose(fptr);
+  return rv;
+}
+
+// Adds every line of fn that ends in a parameter string.
+static int AddParams(ContextPrior* prior, const char* fn) {
+  FILE* fptr = fopen(fn, "r");
+  if (!fptr) {
+    printf("Could not open %s\n", fn);
+    return 0;
+  }
+  int added = 0;
+  char line[512];
+  while (fgets(line, sizeof(line), fptr)) {
+    char* end = line + strlen(line);
+    while (end > line && (end[-1] == '\n' || end[-1] == '\r' || end[-1] == ' ')) *--end = 0;
+    char* str = strrchr(line, ' ');
+    str = str ? str + 1 : line;
+    if (!strncmp(str, "-c", 2)) str += 2;
+    CompressionParameters params;
+    params.format = prior->format;
+    if (params.FromString(str)) {
+      prior->Add(params);
+      ++added;
+    }
+  }
+  fclose(fptr);
+  return added;
+}
+
+int main(int argc, char* argv[]) {
+  const char* out = nullptr;
+  const char* start = nullptr;
+  bool strides = false;
+  std::vector<const char*> images, paramFiles;
+  ContextPrior prior;
+  for (int i = 1; i < argc; ++i) {
+    if (argv[i][0] == '-') {
+      switch (argv[i][1]) {
+        case 'o': out = &argv[i][2]; break;
+        case 'i': start = &argv[i][2]; break;
+        case 'p': paramFiles.push_back(&argv[i][2]); break;
+        case 'f':
+          if (!strcmp(&argv[i][2], "bytemodel")) prior.format = MODEL_BYTE;
+          if (!strcmp(&argv[i][2], "mix")) prior.format = MODEL_MIX;
+          if (!strcmp(&argv[i][2], "strides")) strides = true;
+          break;
+      }
+    } else {
+      images.push_back(argv[i]);
+    }
+  }
+  if (!out || (images.empty() && paramFiles.empty())) {
+    printf("Usage: prior -o<prior> [-i<prior to add to>] [-fbytemodel|-fmix] [-fstrides] [-p<params file>] [images]\n");
+    return 1;
+  }
+  if (start) {
+    int format = prior.format;
+    if (!prior.Load(start) || prior.format != format) {
+      printf("Could not load a prior for this format from %s\n", start);
+      return 1;
+    }
+  }
+
+  for (const char* fn : paramFiles) {
+    printf("%s: %d parameter sets\n", fn, AddParams(&prior, fn));
+  }
+  Compressor* c = new Compressor();
+  c->SetQuiet(true);
+  c->SetStrides(strides);
+  for (const char* fn : images) {
+    std::vector<u8> data;
+    if (!ReadFile(fn, &data) || data.empty()) {
+      printf("Could not read %s\n", fn);
+      continue;
+    }
+    CompressionParameters params;
+    params.format = prior.format;
+    c->Optimize(&params, data.data(), data.size(), nullptr, nullptr, nullptr);
+    char buf[128];
+    params.ToString(buf);
+    printf("%s: %d bytes, %d compressed, %s\n", fn, (int)data.size(),
+           c->TrialSize(&params, data.data(), data.size()), buf);
+    prior.Add(params);
+  }
+  delete c;
+
+  if (!prior.inputs) {
+    printf("Nothing to mine\n");
+    return 1;
+  }
+  if (!prior.Save(out)) {
+    printf("Could not write %s\n", out);
+    return 1;
+  }
+  printf("Wrote %d masks from %d inputs to %s\n", prior.count, prior.inputs, out);
+  for (int i = 0; i < prior.count && i < 8; ++i) {
+    printf("  %2.2x: %d inputs, weight %d\n", prior.masks[i], prior.hits[i], prior.weights[i]);
+  }
+  return 0;
+}
@@ -0,0 +1,61 @@
+// Copyright 2014 Google Inc. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// elfling - a linking compressor for ELF files by Minas ^ Calodox
+
+// Compresses a file with pruning weighed against startup time, as
+// -fprune -fstartup-weight do, and checks that it decompresses again.
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include "pack.h"
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    printf("Usage: prunetest <file>\n");
+    return 1;
+  }
+  FILE* fptr = fopen(argv[1], "rb");
+  if (!fptr) {
+    printf("Could not open %s\n", argv[1]);
+    return 1;
+  }
+  std::vector<u8> in(65536);
+  int inLen = fread(in.data(), 1, in.size(), fptr);
+  fclose(fptr);
+
+  Compressor* c = new Compressor();
+  c->SetQuiet(true);
+  c->SetPrune(true);
+  c->SetStartupWeight(0.5);
+  CompressionParameters params;
+  // The decoder reads the stream from its end and looks back 8 bytes before
+  // the output, so both get 8 bytes in front.
+  std::vector<u8> out(2 * inLen + 1024 + 8, 0), back(inLen + 8, 0);
+  int outLen = 2 * inLen + 1024;
+  if (!c->Compress(&params, in.data(), inLen, out.data() + 8, &outLen)) {
+    printf("Could not compress %s\n", argv[1]);
+    return 1;
+  }
+  std::reverse(out.begin() + 8, out.begin() + 8 + outLen);
+  c->Decompress(&params, out.data() + 8 + outLen - 4, back.data() + 8, inLen);
+  delete c;
+  char buf[128];
+  params.ToString(buf);
+  bool ok = !memcmp(back.data() + 8, in.data(), inLen);
+  printf("%s: %d -> %d bytes with %s, %s\n", argv[1], inLen, outLen, buf, ok ? "ok" : "MISMATCH");
+  return ok ? 0 : 1;
+}
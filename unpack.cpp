@@ -20,12 +20,30 @@
 #include <string.h>
 
 void Compressor::Decompress(CompressionParameters* params, void* in, void* out, int outLen) {
+  Segment segment;
+  segment.params = *params;
+  DecompressSegments(&segment, 1, in, out, outLen);
+}
+
+void Compressor::DecompressSegments(const Segment* segments, int count, void* in, void* out, int outLen) {
+  if (segments[0].params.format == MODEL_BYTE) {
+    DecompressSegmentsByte(segments, count, in, out, outLen);
+    return;
+  }
+  const CompressionParameters* params = &segments[0].params;
+  int next = 1;  // Segment to switch to.
   u8* counters[MAX_CONTEXT_COUNT];  // Counter base offsets
   u8* cp[MAX_CONTEXT_COUNT];  // Current counters
   u8* archive = (u8*)in;
   u8* cout = (u8*)out;
+  bool mix = params->format == MODEL_MIX;
+  int w[MAX_CONTEXT_COUNT], st[MAX_CONTEXT_COUNT], p1 = 0;
+  for (int m = 0; m < params->contextCount; ++m) {
+    w[m] = params->weights[m] << 10;
+  }
 
   memset(modelCounters_, 0, MAX_CONTEXT_SIZE * params->contextCount);
+  byteSlotsValid_ = false;
   u8* base = modelCounters_; 
   for (int m = 0; m < params->contextCount; ++m) {
     counters[m] = base;
@@ -36,14 +54,19 @@ void Compressor::Decompress(CompressionParameters* params, void* in, void* out,
   *cout = 1;
   u32 x1 = 0, x2 = 0xffffffff;                              
   for (u32 j = outLen * 8; j > 0; --j) {
-    u32 n0 = 1, n1 = 1;
-    for (char m = 0; m < params->contextCount; ++m) {
-      n0 += cp[m][0] * params->weights[m];
-      n1 += cp[m][1] * params->weights[m];
+    u32 xmid;
+    if (mix) {
+      p1 = MixPredict(params->contextCount, cp, w, st);
+      xmid = MixSplit(x1, x2, p1);
+    } else {
+      u32 n0 = 1, n1 = 1;
+      for (char m = 0; m < params->contextCount; ++m) {
+        n0 += cp[m][0] * params->weights[m];
+        n1 += cp[m][1] * params->weights[m];
+      }
+      xmid = RangeSplit(x1, x2, n0, n1);
     }
 
-    u32 xmid = x1 + n0 * (u64)(x2 - x1) / (n0 + n1);
-
     char y;
     cout[0] <<= 1;
     if (*(u32*)archive <= xmid) {
@@ -55,21 +78,29 @@ void Compressor::Decompress(CompressionParameters* params, void* in, void* out,
       y = 1;
     }
 
-    if (((j - 1) & 7) == 0) {  // Start new byte
+    if (((j - 1) & 7) == 0 && j > 1) {  // Start new byte, unless that was the last
       cout++;
       *cout = 1;
+      if (next < count && cout - (u8*)out == segments[next].start) params = &segments[next++].params;
     }
     
     // Count y by context
-    for (char m = 0; m < params->contextCount; ++m) {
-      if (cp[m][y] < 255)
-        ++cp[m][y];
-      if (cp[m][1 - y] > 2)
-        cp[m][1 - y] = cp[m][1 - y] / 2 + 1;
+    if (mix) MixUpdate(params->contextCount, cp, w, st, y, p1);
+    for (int m = 0; m < params->contextCount; ++m) {
+      if (!mix) {
+        if (cp[m][y] < 255)
+          ++cp[m][y];
+        if (cp[m][1 - y] > 2)
+          cp[m][1 - y] = cp[m][1 - y] / 2 + 1;
+      }
       u32 off = 0, cnt = 0;
-      for (char i = 0; i < 8; ++i) {
-        if (params->contexts[m] & (1 << i)) {
-          off = (off << 8) + cout[-i];
+      if (IsStride(params->contexts[m])) {
+        off = StrideKey(params->contexts[m], cout[0], (u8*)out, cout - (u8*)out);
+      } else {
+        for (char i = 0; i < 8; ++i) {
+          if (params->contexts[m] & (1 << i)) {
+            off = (off << 8) + cout[-i];
+          }
         }
       }
       u32 c = 0;
@@ -86,3 +117,145 @@ void Compressor::Decompress(CompressionParameters* params, void* in, void* out,
   }
 }
 
+
+void Compressor::DecompressSegmentsByte(const Segment* segments, int count, void* in, void* out, int outLen) {
+  const CompressionParameters* params = &segments[0].params;
+  int next = 1;  // Segment to switch to.
+  u8* counters[MAX_CONTEXT_COUNT];  // Slot table base offsets
+  u8* slot[MAX_CONTEXT_COUNT];  // Slots for the current byte
+  u8* archive = (u8*)in;
+  u8* cout = (u8*)out;
+
+  u32 slotCount = sizeof(modelCounters_) / params->contextCount / BYTE_SLOT_SIZE;
+  u8* base = ClearByteSlots();
+  for (int m = 0; m < params->contextCount; ++m) {
+    counters[m] = base;
+    base += slotCount * BYTE_SLOT_SIZE;
+  }
+  // Slots used here are not recorded, clear everything next time.
+  byteSlotsValid_ = false;
+
+  *cout = 1;
+  u32 x1 = 0, x2 = 0xffffffff;
+  for (u32 j = outLen * 8; j > 0; --j) {
+    if (cout[0] == 1) {  // New byte, find the slot of each context.
+      for (int m = 0; m < params->contextCount; ++m) {
+        u32 off = 0;
+        if (IsStride(params->contexts[m])) {
+          off = StrideKey(params->contexts[m], cout[0], (u8*)out, cout - (u8*)out);
+        } else {
+          for (int i = 0; i < 8; ++i) {
+            if (params->contexts[m] & (1 << i)) {
+              off = (off << 8) + cout[-i];
+            }
+          }
+        }
+        u32 c = 0;
+        while (*(u32*)&counters[m][c] != 0 && *(u32*)&counters[m][c] != off) c += BYTE_SLOT_SIZE;
+        *(u32*)&counters[m][c] = off;
+        slot[m] = &counters[m][c];
+      }
+    }
+
+    u32 n0 = 1, n1 = 1;
+    for (int m = 0; m < params->contextCount; ++m) {
+      u8* cp = slot[m] + 2 + 2 * cout[0];
+      n0 += cp[0] * params->weights[m];
+      n1 += cp[1] * params->weights[m];
+    }
+
+    u32 xmid = RangeSplit(x1, x2, n0, n1);
+
+    int y;
+    if (*(u32*)archive <= xmid) {
+      x2 = xmid;
+      y = 0;
+    } else {
+      x1 = xmid + 1;
+      y = 1;
+    }
+
+    // Count y by context
+    for (int m = 0; m < params->contextCount; ++m) {
+      u8* cp = slot[m] + 2 + 2 * cout[0];
+      if (cp[y] < 255)
+        ++cp[y];
+      if (cp[1 - y] > 2)
+        cp[1 - y] = cp[1 - y] / 2 + 1;
+    }
+
+    cout[0] += cout[0] + y;
+    if (((j - 1) & 7) == 0 && j > 1) {  // Start new byte, unless that was the last
+      cout++;
+      *cout = 1;
+      if (next < count && cout - (u8*)out == segments[next].start) params = &segments[next++].params;
+    }
+
+    while (((x1 ^ x2) >> 24) == 0) {
+      x1 <<= 8;
+      x2 = (x2 << 8) + 255;
+      --archive;
+    }
+  }
+}
+
+StreamDecoder::StreamDecoder(const CompressionParameters& params, ReadFn read, void* ctx)
+    : model_(params), read_(read), ctx_(ctx) {
+  for (int i = 0; i < 4; ++i) {
+    x_ = (x_ << 8) + Get();
+  }
+}
+
+void StreamDecoder::Reset(const CompressionParameters& params, ReadFn read, void* ctx) {
+  model_.Reset(params);
+  x1_ = 0;
+  x2_ = 0xffffffff;
+  x_ = 0;
+  read_ = read;
+  ctx_ = ctx;
+  bufferPos_ = 0;
+  bufferLen_ = 0;
+  for (int i = 0; i < 4; ++i) {
+    x_ = (x_ << 8) + Get();
+  }
+}
+
+void StreamDecoder::Decode(void* out, int outLen) {
+  u8* cout = (u8*)out;
+  for (int j = 0; j < outLen; ++j) {
+    u32 byte = 0;
+    for (u32 i = 0; i < 8; ++i) {
+      u32 n0, n1;
+      model_.Predict(&n0, &n1);
+      u32 xmid = RangeSplit(x1_, x2_, n0, n1);
+      int y;
+      if (x_ <= xmid) {
+        x2_ = xmid;
+        y = 0;
+      } else {
+        x1_ = xmid + 1;
+        y = 1;
+      }
+      model_.Update(y);
+      byte += byte + y;
+      while (((x1_ ^ x2_) & 0xff000000) == 0) {
+        x1_ <<= 8;
+        x2_ = (x2_ << 8) + 255;
+        x_ = (x_ << 8) + Get();
+      }
+    }
+    *cout++ = byte;
+  }
+}
+
+u8 StreamDecoder::Get() {
+  if (bufferPos_ == bufferLen_) {
+    bufferLen_ = read_(ctx_, buffer_, sizeof(buffer_));
+    bufferPos_ = 0;
+    if (bufferLen_ <= 0) {
+      bufferLen_ = 0;
+      return 0;  // Past the end of the stream.
+    }
+  }
+  return buffer_[bufferPos_++];
+}